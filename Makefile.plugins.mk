@@ -20,8 +20,29 @@ HIPHOP_INJECT_FRAMEWORK_JS ?= false
 HIPHOP_LINUX_WEBVIEW ?= gtk
 # WebAssembly runtime library [ wamr | wasmer ]
 HIPHOP_WASM_RUNTIME ?= wamr
-# WebAssembly execution mode - WAMR [ aot | interp ], Wasmer [ jit ]
+# WebAssembly execution mode - WAMR [ aot | interp | tiered ], Wasmer [ jit ]
+# Tiered starts on the interpreter and switches to AOT once it is loaded. DSP
+# state only carries over for modules implementing serialize_state(), others
+# switch when the plugin is next deactivated so playback does not click.
 HIPHOP_WASM_MODE ?= aot
+# Cache compiled WebAssembly modules in the user data directory, Wasmer only
+HIPHOP_WASM_MODULE_CACHE ?= true
+# Also build AOT modules for AVX2 and AVX-512 CPUs, picked at runtime, x86_64 only
+HIPHOP_WASM_AOT_VARIANTS ?= true
+# Build AssemblyScript DSP with the Wasm SIMD feature, not available for WAMR interp
+HIPHOP_WASM_SIMD ?= true
+# Native FFT, FIR and resampling kernels callable from AssemblyScript, see dpf.ts
+HIPHOP_WASM_NATIVE_KERNELS ?= false
+# Catch out of bounds memory accesses with guard pages instead of software
+# checks in AOT code, WAMR on x86_64 Linux only. See WasmTrapHandler.hpp
+HIPHOP_WASM_HW_BOUND_CHECK ?= false
+# Instantiate the Wasm module on first activation or state restore, metadata is
+# served from a descriptor generated at build time. HIPHOP_WASM_*_COUNT must be
+# set to the WasmPlugin constructor arguments, the descriptor is ignored otherwise.
+HIPHOP_WASM_LAZY ?= false
+HIPHOP_WASM_PARAMETER_COUNT ?=
+HIPHOP_WASM_PROGRAM_COUNT ?=
+HIPHOP_WASM_STATE_COUNT ?=
 # Universal build not available for Wasmer DSP
 # Set to false for building current architecture only
 HIPHOP_MACOS_UNIVERSAL ?= false
@@ -154,7 +175,15 @@ FILES_UI += $(HIPHOP_FILES_SHARED:%=$(HIPHOP_SRC_PATH)/%)
 
 ifeq ($(WASM_DSP),true)
 HIPHOP_FILES_DSP += WasmPluginImpl.cpp \
-					WasmRuntime.cpp
+					WasmRuntime.cpp \
+					WasmModuleCache.cpp \
+					WasmModuleRegistry.cpp
+ifeq ($(HIPHOP_WASM_NATIVE_KERNELS),true)
+HIPHOP_FILES_DSP += NativeKernels.cpp
+endif
+ifeq ($(HIPHOP_WASM_HW_BOUND_CHECK),true)
+HIPHOP_FILES_DSP += WasmTrapHandler.cpp
+endif
 endif
 
 FILES_DSP += $(HIPHOP_FILES_DSP:%=$(HIPHOP_SRC_PATH)/dsp/%)
@@ -278,7 +307,14 @@ ifeq ($(WASM_DSP),true)
   WASM_BYTECODE_FILE = optimized.wasm
   ifeq ($(HIPHOP_WASM_RUNTIME),wamr)
 	BASE_FLAGS += -DHIPHOP_WASM_RUNTIME_WAMR
-	ifeq ($(HIPHOP_WASM_MODE),aot)
+	ifeq ($(HIPHOP_WASM_MODE),tiered)
+	  ifeq ($(WINDOWS),true)
+	  $(error Tiered mode is not supported on Windows)
+	  endif
+	BASE_FLAGS += -DHIPHOP_WASM_TIERED
+	WASM_TIERED_FILES = $(WASM_BYTECODE_FILE)
+	endif
+	ifneq ($(filter aot tiered,$(HIPHOP_WASM_MODE)),)
 	  ifeq ($(CPU_I386_OR_X86_64),true)
 	  WAMRC_TARGET = x86_64
 	  endif
@@ -287,6 +323,12 @@ ifeq ($(WASM_DSP),true)
 	  endif
 	  WASM_BINARY_FILE = $(WAMRC_TARGET).aot
 	  BASE_FLAGS += -DHIPHOP_WASM_BINARY_COMPILED
+	  ifeq ($(HIPHOP_WASM_AOT_VARIANTS),true)
+	  ifeq ($(WAMRC_TARGET),x86_64)
+	  WASM_AOT_VARIANT_FILES = x86_64-avx2.aot x86_64-avx512.aot
+	  BASE_FLAGS += -DHIPHOP_WASM_AOT_VARIANTS
+	  endif
+	  endif
 	endif
 	ifeq ($(HIPHOP_WASM_MODE),interp)
 	WASM_BINARY_FILE = $(WASM_BYTECODE_FILE)
@@ -294,6 +336,16 @@ ifeq ($(WASM_DSP),true)
 	ifeq ($(HIPHOP_WASM_MODE),jit)
 	$(error JIT mode is not supported for WAMR)
 	endif
+	ifeq ($(HIPHOP_WASM_HW_BOUND_CHECK),true)
+	  ifneq ($(LINUX)$(WAMRC_TARGET),truex86_64)
+	  $(error Hardware bounds checking is only supported for AOT on x86_64 Linux)
+	  endif
+	BASE_FLAGS += -DHIPHOP_WASM_HW_BOUND_CHECK
+	endif
+	ifneq ($(filter interp tiered,$(HIPHOP_WASM_MODE)),)
+	# WAMR interpreters cannot execute SIMD instructions
+	HIPHOP_WASM_SIMD = false
+	endif
   endif
   ifeq ($(HIPHOP_WASM_RUNTIME),wasmer)
 	BASE_FLAGS += -DHIPHOP_WASM_RUNTIME_WASMER
@@ -306,6 +358,22 @@ ifeq ($(WASM_DSP),true)
 	else
 	$(error Only JIT mode is supported for Wasmer)
 	endif
+	ifeq ($(HIPHOP_WASM_MODULE_CACHE),true)
+	BASE_FLAGS += -DHIPHOP_WASM_MODULE_CACHE
+	endif
+  endif
+  ifeq ($(HIPHOP_WASM_SIMD),true)
+  ASC_FLAGS += --enable simd
+  endif
+  ifeq ($(HIPHOP_WASM_NATIVE_KERNELS),true)
+  BASE_FLAGS += -DHIPHOP_WASM_NATIVE_KERNELS
+  endif
+  ifeq ($(HIPHOP_WASM_LAZY),true)
+  ifneq ($(words $(HIPHOP_WASM_PARAMETER_COUNT) $(HIPHOP_WASM_PROGRAM_COUNT) $(HIPHOP_WASM_STATE_COUNT)),3)
+  $(error HIPHOP_WASM_*_COUNT must be set when HIPHOP_WASM_LAZY is enabled)
+  endif
+  BASE_FLAGS += -DHIPHOP_WASM_LAZY
+  WASM_DESCRIPTOR_FILES = descriptor.bin
   endif
   ifeq ($(HIPHOP_WASM_RUNTIME),wamr)
 	BASE_FLAGS += -I$(WAMR_PATH)/core/iwasm/include
@@ -557,6 +625,7 @@ ifeq ($(WASM_DSP),true)
 ifeq ($(HIPHOP_WASM_RUNTIME),wamr)
 WAMR_GIT_URL = https://github.com/bytecodealliance/wasm-micro-runtime
 WAMR_GIT_TAG = WAMR-1.3.2
+BASE_FLAGS += -DHIPHOP_WASM_RUNTIME_VERSION=$(WAMR_GIT_TAG)
 WAMR_PATH = $(HIPHOP_DEPS_PATH)/wasm-micro-runtime
 WAMR_BUILD_PATH = ${WAMR_PATH}/build-$(HIPHOP_WASM_MODE)
 WAMR_LIB_PATH = $(WAMR_BUILD_PATH)/libvmlib.a
@@ -568,13 +637,26 @@ WAMRC_BIN_PATH = $(WAMRC_PATH)/build/wamrc
 # Disable WASI feature because it is not exposed by the WAMR C API.
 # HW_BOUND_CHECK not compiling on MinGW, leads to muted plugins on Linux+AOT and
 # crashing on Mac+AOT https://github.com/bytecodealliance/wasm-micro-runtime/pull/1001
-WAMR_CMAKE_ARGS = -DWAMR_BUILD_LIBC_WASI=0 -DWAMR_DISABLE_HW_BOUND_CHECK=1
+# It is opt-in on x86_64 Linux, where WasmTrapHandler initializes the runtime
+# signal state on every thread calling into Wasm.
+WAMR_CMAKE_ARGS = -DWAMR_BUILD_LIBC_WASI=0
+ifeq ($(HIPHOP_WASM_HW_BOUND_CHECK),true)
+WAMR_CMAKE_ARGS += -DWAMR_DISABLE_HW_BOUND_CHECK=0
+else
+WAMR_CMAKE_ARGS += -DWAMR_DISABLE_HW_BOUND_CHECK=1
+endif
 ifeq ($(HIPHOP_WASM_MODE),aot)
 WAMR_CMAKE_ARGS += -DWAMR_BUILD_AOT=1 -DWAMR_BUILD_INTERP=0
+ifeq ($(HIPHOP_WASM_SIMD),true)
+WAMR_CMAKE_ARGS += -DWAMR_BUILD_SIMD=1
+endif
 endif
 ifeq ($(HIPHOP_WASM_MODE),interp)
 WAMR_CMAKE_ARGS += -DWAMR_BUILD_AOT=0 -DWAMR_BUILD_INTERP=1
 endif
+ifeq ($(HIPHOP_WASM_MODE),tiered)
+WAMR_CMAKE_ARGS += -DWAMR_BUILD_AOT=1 -DWAMR_BUILD_INTERP=1 -DWAMR_BUILD_FAST_INTERP=1
+endif
 
 ifeq ($(WINDOWS),true)
 # Use the C version of invokeNative() instead of ASM until MinGW build is fixed.
@@ -604,7 +686,7 @@ TARGETS += $(WAMR_DLL_PATH)
 endif
 endif
 
-ifeq ($(HIPHOP_WASM_MODE),aot)
+ifneq ($(filter aot tiered,$(HIPHOP_WASM_MODE)),)
 TARGETS += $(WAMRC_BIN_PATH)
 endif
 
@@ -637,6 +719,7 @@ ifeq ($(WASM_DSP),true)
 ifeq ($(HIPHOP_WASM_RUNTIME),wasmer)
 WASMER_URL = https://github.com/wasmerio/wasmer/releases/download
 WASMER_VERSION = 2.1.1
+BASE_FLAGS += -DHIPHOP_WASM_RUNTIME_VERSION=$(WASMER_VERSION)
 WASMER_PATH = $(HIPHOP_DEPS_PATH)/wasmer
 
 TARGETS += $(WASMER_PATH)
@@ -919,6 +1002,9 @@ endif
 AS_BUILD_PATH = $(HIPHOP_AS_DSP_PATH)/build
 WASM_BYTECODE_PATH = $(AS_BUILD_PATH)/$(WASM_BYTECODE_FILE)
 WASM_BINARY_PATH = $(AS_BUILD_PATH)/$(WASM_BINARY_FILE)
+WASM_AOT_VARIANT_PATHS = $(WASM_AOT_VARIANT_FILES:%=$(AS_BUILD_PATH)/%)
+WASM_TIERED_PATHS = $(WASM_TIERED_FILES:%=$(AS_BUILD_PATH)/%)
+WASM_DESCRIPTOR_PATHS = $(WASM_DESCRIPTOR_FILES:%=$(AS_BUILD_PATH)/%)
 
 HIPHOP_TARGET += $(WASM_BYTECODE_PATH)
 
@@ -927,21 +1013,101 @@ $(WASM_BYTECODE_PATH): $(AS_ASSEMBLY_PATH)/plugin.ts
 	@# npm --prefix fails on MinGW due to paths mixing \ and /
 	@test -d $(HIPHOP_AS_DSP_PATH)/node_modules \
 		|| (cd $(HIPHOP_AS_DSP_PATH) && $(NPM_OPT_SET_PATH) && npm install)
-	@cd $(HIPHOP_AS_DSP_PATH) && $(NPM_OPT_SET_PATH) && npm run asbuild
+	@cd $(HIPHOP_AS_DSP_PATH) && $(NPM_OPT_SET_PATH) \
+		&& npm run asbuild:untouched -- $(ASC_FLAGS) \
+		&& npm run asbuild:optimized -- $(ASC_FLAGS)
+
+ifneq ($(WASM_DESCRIPTOR_FILES),)
+HIPHOP_TARGET += $(WASM_DESCRIPTOR_PATHS)
+
+$(WASM_DESCRIPTOR_PATHS): $(WASM_BYTECODE_PATH)
+	@echo "Generating plugin descriptor"
+	@$(NPM_OPT_SET_PATH) && node $(HIPHOP_SRC_PATH)/dsp/describe.js $(WASM_BYTECODE_PATH) $@ \
+		$(HIPHOP_WASM_PARAMETER_COUNT) $(HIPHOP_WASM_PROGRAM_COUNT) $(HIPHOP_WASM_STATE_COUNT)
+endif
+
+# Times run() of the optimized module built with and without SIMD, not part of
+# the default target. Usage: make wasm_bench [WASM_BENCH_ARGS="--notes 4"]
+# See dsp/bench.js for options.
+WASM_BENCH_ASC_FLAGS = $(filter-out --enable simd,$(ASC_FLAGS))
+
+wasm_bench:
+	@echo "Building AssemblyScript project for benchmarking"
+	@test -d $(HIPHOP_AS_DSP_PATH)/node_modules \
+		|| (cd $(HIPHOP_AS_DSP_PATH) && $(NPM_OPT_SET_PATH) && npm install)
+	@cd $(HIPHOP_AS_DSP_PATH) && $(NPM_OPT_SET_PATH) \
+		&& npm run asbuild:optimized -- $(WASM_BENCH_ASC_FLAGS) \
+			--binaryFile build/bench-scalar.wasm --textFile build/bench-scalar.wat \
+		&& npm run asbuild:optimized -- $(WASM_BENCH_ASC_FLAGS) --enable simd \
+			--binaryFile build/bench-simd.wasm --textFile build/bench-simd.wat
+	@$(NPM_OPT_SET_PATH) && node $(HIPHOP_SRC_PATH)/dsp/bench.js $(WASM_BENCH_ARGS) \
+		$(AS_BUILD_PATH)/bench-scalar.wasm $(AS_BUILD_PATH)/bench-simd.wasm
 
 ifeq ($(HIPHOP_WASM_RUNTIME),wamr)
-ifeq ($(HIPHOP_WASM_MODE),aot)
+ifneq ($(filter aot tiered,$(HIPHOP_WASM_MODE)),)
 HIPHOP_TARGET += $(WASM_BINARY_PATH)
 
 ifeq ($(CPU_I386_OR_X86_64),true)
 # https://github.com/bytecodealliance/wasm-micro-runtime/issues/1022
 WAMRC_ARGS = --cpu=sandybridge
 endif
+ifneq ($(HIPHOP_WASM_SIMD),true)
+WAMRC_ARGS += --disable-simd
+endif
+# wamrc omits bounds checks for 64-bit targets unless told otherwise, they are
+# required when the runtime has no guard pages
+ifeq ($(HIPHOP_WASM_HW_BOUND_CHECK),true)
+WAMRC_BOUNDS_ARGS = --bounds-checks=0
+else
+WAMRC_BOUNDS_ARGS = --bounds-checks=1
+endif
 
 $(WASM_BINARY_PATH): $(WASM_BYTECODE_PATH)
 	@echo "Compiling WASM AOT module"
 	@$(WAMRC_BIN_PATH) --target=$(WAMRC_TARGET) -o $(WASM_BINARY_PATH) $(WAMRC_ARGS) \
+		$(WAMRC_BOUNDS_ARGS) $(WASM_BYTECODE_PATH)
+
+ifneq ($(WASM_AOT_VARIANT_FILES),)
+HIPHOP_TARGET += $(WASM_AOT_VARIANT_PATHS)
+
+# Same arguments as the baseline module except for the CPU, SIMD must also be
+# disabled when the runtime is built without it
+WAMRC_VARIANT_ARGS = $(filter-out --cpu=%,$(WAMRC_ARGS)) $(WAMRC_BOUNDS_ARGS)
+
+$(AS_BUILD_PATH)/x86_64-avx2.aot: $(WASM_BYTECODE_PATH)
+	@echo "Compiling WASM AOT module for AVX2"
+	@$(WAMRC_BIN_PATH) --target=$(WAMRC_TARGET) -o $@ --cpu=haswell $(WAMRC_VARIANT_ARGS) \
 		$(WASM_BYTECODE_PATH)
+
+$(AS_BUILD_PATH)/x86_64-avx512.aot: $(WASM_BYTECODE_PATH)
+	@echo "Compiling WASM AOT module for AVX-512"
+	@$(WAMRC_BIN_PATH) --target=$(WAMRC_TARGET) -o $@ --cpu=skylake-avx512 $(WAMRC_VARIANT_ARGS) \
+		$(WASM_BYTECODE_PATH)
+endif
+
+ifeq ($(HIPHOP_WASM_HW_BOUND_CHECK),true)
+# Times run() of the AOT module compiled with and without software bounds
+# checks on the guard page runtime, not part of the default target.
+# Usage: make wamr_bench [WASM_BENCH_ARGS="--notes 4"]
+WAMR_BENCH_PATH = $(AS_BUILD_PATH)/bench_wamr
+
+wamr_bench: $(WAMR_BENCH_PATH) $(AS_BUILD_PATH)/bench-sw-bounds.aot $(AS_BUILD_PATH)/bench-hw-bounds.aot
+	@$(WAMR_BENCH_PATH) $(WASM_BENCH_ARGS) \
+		$(AS_BUILD_PATH)/bench-sw-bounds.aot $(AS_BUILD_PATH)/bench-hw-bounds.aot
+
+$(WAMR_BENCH_PATH): $(HIPHOP_SRC_PATH)/dsp/bench_wamr.cpp $(WAMR_LIB_PATH)
+	@echo "Compiling WAMR benchmark"
+	@$(CXX) -std=gnu++11 -O2 -I$(WAMR_PATH)/core/iwasm/include -o $@ $< $(WAMR_LIB_PATH) \
+		-lpthread -lm -ldl
+
+$(AS_BUILD_PATH)/bench-sw-bounds.aot: $(WASM_BYTECODE_PATH)
+	@$(WAMRC_BIN_PATH) --target=$(WAMRC_TARGET) -o $@ $(WAMRC_ARGS) --bounds-checks=1 \
+		$(WASM_BYTECODE_PATH)
+
+$(AS_BUILD_PATH)/bench-hw-bounds.aot: $(WASM_BYTECODE_PATH)
+	@$(WAMRC_BIN_PATH) --target=$(WAMRC_TARGET) -o $@ $(WAMRC_ARGS) --bounds-checks=0 \
+		$(WASM_BYTECODE_PATH)
+endif
 endif
 endif
 endif
@@ -956,23 +1122,28 @@ lib_dsp:
 	@echo "Copying WebAssembly DSP binary"
 	@($(TEST_LV2) \
 		&& mkdir -p $(LIB_DIR_LV2)/dsp \
-		&& cp -r $(WASM_BINARY_PATH) $(LIB_DIR_LV2)/dsp/$(WASM_BINARY_FILE) \
+		&& cp -r $(WASM_BINARY_PATH) $(WASM_AOT_VARIANT_PATHS) $(WASM_TIERED_PATHS) \
+			$(WASM_DESCRIPTOR_PATHS) $(LIB_DIR_LV2)/dsp \
 		) || true
 	@($(TEST_CLAP_MACOS) \
 		&& mkdir -p $(LIB_DIR_CLAP_MACOS)/dsp \
-		&& cp -r $(WASM_BINARY_PATH) $(LIB_DIR_CLAP_MACOS)/dsp/$(WASM_BINARY_FILE) \
+		&& cp -r $(WASM_BINARY_PATH) $(WASM_AOT_VARIANT_PATHS) $(WASM_TIERED_PATHS) \
+			$(WASM_DESCRIPTOR_PATHS) $(LIB_DIR_CLAP_MACOS)/dsp \
 		) || true
 	@($(TEST_VST3) \
 		&& mkdir -p $(LIB_DIR_VST3)/dsp \
-		&& cp -r $(WASM_BINARY_PATH) $(LIB_DIR_VST3)/dsp/$(WASM_BINARY_FILE) \
+		&& cp -r $(WASM_BINARY_PATH) $(WASM_AOT_VARIANT_PATHS) $(WASM_TIERED_PATHS) \
+			$(WASM_DESCRIPTOR_PATHS) $(LIB_DIR_VST3)/dsp \
 		) || true
 	@($(TEST_VST2_MACOS) \
 		&& mkdir -p $(LIB_DIR_VST2_MACOS)/dsp \
-		&& cp -r $(WASM_BINARY_PATH) $(LIB_DIR_VST2_MACOS)/dsp/$(WASM_BINARY_FILE) \
+		&& cp -r $(WASM_BINARY_PATH) $(WASM_AOT_VARIANT_PATHS) $(WASM_TIERED_PATHS) \
+			$(WASM_DESCRIPTOR_PATHS) $(LIB_DIR_VST2_MACOS)/dsp \
 		) || true
 	@($(TEST_NOBUNDLE) \
 		&& mkdir -p $(LIB_DIR_NOBUNDLE)/dsp \
-		&& cp -r $(WASM_BINARY_PATH) $(LIB_DIR_NOBUNDLE)/dsp/$(WASM_BINARY_FILE) \
+		&& cp -r $(WASM_BINARY_PATH) $(WASM_AOT_VARIANT_PATHS) $(WASM_TIERED_PATHS) \
+			$(WASM_DESCRIPTOR_PATHS) $(LIB_DIR_NOBUNDLE)/dsp \
 		) || true
 endif
 
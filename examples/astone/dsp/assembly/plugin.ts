@@ -86,8 +86,27 @@ export default class ASToneExamplePlugin extends DISTRHO.Plugin implements DISTR
 
         let sample: f32
         let phase: f32 = this.phase
+        let i = 0
+
+        if (ASC_FEATURE_SIMD) {
+            const ptr_l = output_l.dataStart
+            const ptr_r = output_r.dataStart
+            const step = f32x4.splat(4 * radiansPerSample)
+            let phases = f32x4.add(f32x4.splat(phase),
+                                   f32x4.mul(f32x4(0, 1, 2, 3), f32x4.splat(radiansPerSample)))
+
+            for (; i + 4 <= output_l.length; i += 4) {
+                const offset = <usize>i << 2
+                const samples = DISTRHO.sin4(phases)
+                v128.store(ptr_l + offset, samples)
+                v128.store(ptr_r + offset, samples)
+                phases = f32x4.add(phases, step)
+            }
+
+            phase = f32x4.extract_lane(phases, 0)
+        }
 
-        for (let i = 0; i < output_l.length; ++i) {
+        for (; i < output_l.length; ++i) {
             sample = Mathf.sin(phase)
             phase += radiansPerSample
             output_l[i] = output_r[i] = sample
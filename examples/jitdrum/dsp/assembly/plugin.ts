@@ -62,8 +62,32 @@ export default class JITDrumExamplePlugin extends DISTRHO.Plugin implements DIST
 
         let t: f32
         let k: f32
+        let i = 0
+
+        if (ASC_FEATURE_SIMD) {
+            // Same as the scalar loop below, 4 frames at a time
+            const ptr_l = outputs[0].dataStart
+            const ptr_r = outputs[1].dataStart
+            const invSr = f32x4.splat(1 / this.sr)
+            const a = f32x4.splat(this.a)
+            const f = f32x4.splat(this.f)
+
+            for (; i + 4 <= outputs[0].length; i += 4) {
+                const frames = f32x4.add(f32x4.splat(<f32>this.t), f32x4(0, 1, 2, 3))
+                const negT = f32x4.neg(f32x4.mul(frames, invSr))
+                const punch = DISTRHO.exp4(f32x4.mul(negT, f32x4.splat(PUNCH)))
+                const decay = DISTRHO.exp4(f32x4.mul(negT, f32x4.splat(DECAY)))
+                const osc = DISTRHO.sin4(f32x4.mul(f, f32x4.sub(punch, f32x4.splat(1))))
+                const samples = f32x4.mul(f32x4.mul(a, osc), decay)
+
+                const offset = <usize>i << 2
+                v128.store(ptr_l + offset, samples)
+                v128.store(ptr_r + offset, samples)
+                this.t += 4
+            }
+        }
 
-        for (let i = 0; i < outputs[0].length; ++i) {
+        for (; i < outputs[0].length; ++i) {
             // Compute sample; make sure k=0 when t=0 to avoid attack click.
             t = <f32>this.t / this.sr
             k = this.a * Mathf.sin(this.f * (Mathf.exp(PUNCH * -t) - 1)) * Mathf.exp(DECAY * -t)
@@ -59,6 +59,16 @@ public:
 #endif
 
 protected:
+#if DISTRHO_PLUGIN_WANT_STATE
+    typedef std::map<String,String> StateMap;
+
+    // Last value set for every state, or its default
+    const StateMap& getStateMap() const noexcept
+    {
+        return fState;
+    }
+#endif
+
 #if defined(HIPHOP_SHARED_MEMORY_SIZE)
     virtual void sharedMemoryWillDisconnect() {}
     virtual void sharedMemoryConnected(uint8_t* ptr)
@@ -88,8 +98,7 @@ private:
     uint32_t fStateIndexZeroconfId;
     uint32_t fStateIndexZeroconfName;
 #endif
-#if DISTRHO_PLUGIN_WANT_FULL_STATE
-    typedef std::map<String,String> StateMap;
+#if DISTRHO_PLUGIN_WANT_STATE
     StateMap fState;
 #endif
     DISTRHO_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(PluginEx)
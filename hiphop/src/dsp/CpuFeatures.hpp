@@ -0,0 +1,159 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CPU_FEATURES_HPP
+#define CPU_FEATURES_HPP
+
+#include <cstdio>
+#include <cstdint>
+
+#if defined(__i386__) || defined(__x86_64__)
+# include <cpuid.h>
+#endif
+
+#include "src/DistrhoDefines.h"
+#include "distrho/extra/String.hpp"
+
+START_NAMESPACE_DISTRHO
+
+struct CpuFeatures
+{
+    static const char* getArchitecture() noexcept
+    {
+#if defined(__x86_64__)
+        return "x86_64";
+#elif defined(__i386__)
+        return "i386";
+#elif defined(__aarch64__)
+        return "aarch64";
+#elif defined(__arm__)
+        return "arm";
+#else
+        return "unknown";
+#endif
+    }
+
+    // Match the wamrc --cpu=haswell target, also requires OS support for the
+    // extended register state.
+
+    static bool hasAvx2() noexcept
+    {
+#if defined(__i386__) || defined(__x86_64__)
+        unsigned int eax, ebx, ecx, edx;
+
+        if (! __get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+            return false;
+        }
+
+        const uint32_t leaf1Ecx = (1u << 12) /*FMA*/ | (1u << 22) /*MOVBE*/ | (1u << 27) /*OSXSAVE*/
+                                    | (1u << 28) /*AVX*/ | (1u << 29) /*F16C*/;
+        if ((ecx & leaf1Ecx) != leaf1Ecx) {
+            return false;
+        }
+
+        if (! __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+            return false;
+        }
+
+        const uint32_t leaf7Ebx = (1u << 3) /*BMI1*/ | (1u << 5) /*AVX2*/ | (1u << 8) /*BMI2*/;
+        if ((ebx & leaf7Ebx) != leaf7Ebx) {
+            return false;
+        }
+
+        if (! __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || ((ecx & (1u << 5)) == 0) /*LZCNT*/) {
+            return false;
+        }
+
+        return (getXcr0() & 0x6) == 0x6; // XMM and YMM state
+#else
+        return false;
+#endif
+    }
+
+    // Match the wamrc --cpu=skylake-avx512 target
+
+    static bool hasAvx512() noexcept
+    {
+#if defined(__i386__) || defined(__x86_64__)
+        if (! hasAvx2()) {
+            return false;
+        }
+
+        unsigned int eax, ebx, ecx, edx;
+
+        if (! __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+            return false;
+        }
+
+        const uint32_t leaf7Ebx = (1u << 16) /*F*/ | (1u << 17) /*DQ*/ | (1u << 28) /*CD*/
+                                    | (1u << 30) /*BW*/ | (1u << 31) /*VL*/;
+        if ((ebx & leaf7Ebx) != leaf7Ebx) {
+            return false;
+        }
+
+        return (getXcr0() & 0xe6) == 0xe6; // XMM, YMM, opmask and ZMM state
+#else
+        return false;
+#endif
+    }
+
+    // Returns a string that changes whenever the instruction set extensions
+    // available to natively compiled code change, suitable for cache keys.
+
+    static String getSignature() noexcept
+    {
+        char s[64];
+#if defined(__i386__) || defined(__x86_64__)
+        unsigned int eax, ebx, ecx, edx;
+        uint32_t leaf1[2] = { 0, 0 };
+        uint32_t leaf7[2] = { 0, 0 };
+
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+            leaf1[0] = ecx;
+            leaf1[1] = edx;
+        }
+
+        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+            leaf7[0] = ebx;
+            leaf7[1] = ecx;
+        }
+
+        std::snprintf(s, sizeof(s), "%s-%08x%08x%08x%08x", getArchitecture(),
+                        leaf1[0], leaf1[1], leaf7[0], leaf7[1]);
+#else
+        std::snprintf(s, sizeof(s), "%s", getArchitecture());
+#endif
+        return String(s);
+    }
+
+private:
+#if defined(__i386__) || defined(__x86_64__)
+    static uint64_t getXcr0() noexcept
+    {
+        uint32_t eax, edx;
+        __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+
+        return (static_cast<uint64_t>(edx) << 32) | eax;
+    }
+#endif
+
+};
+
+END_NAMESPACE_DISTRHO
+
+#endif  // CPU_FEATURES_HPP
@@ -0,0 +1,129 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOCK_FREE_QUEUE_HPP
+#define LOCK_FREE_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "src/DistrhoDefines.h"
+
+START_NAMESPACE_DISTRHO
+
+// Bounded multi-producer multi-consumer queue after Dmitry Vyukov's design.
+// Each cell carries a sequence number that tells whether it is ready to be
+// written or read, so push() and pop() never block nor allocate. push()
+// fails when the queue is full.
+
+template <typename T, size_t Capacity>
+class LockFreeQueue
+{
+    static_assert((Capacity >= 2) && ((Capacity & (Capacity - 1)) == 0),
+                    "Capacity must be a power of two");
+
+public:
+    LockFreeQueue() noexcept
+        : fEnqueuePos(0)
+        , fDequeuePos(0)
+    {
+        for (size_t i = 0; i < Capacity; i++) {
+            fCells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(const T& value) noexcept
+    {
+        Cell* cell;
+        size_t pos = fEnqueuePos.load(std::memory_order_relaxed);
+
+        while (true) {
+            cell = &fCells[pos & (Capacity - 1)];
+            const size_t seq = cell->sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+            if (diff == 0) {
+                if (fEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = fEnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->value = value;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    bool pop(T& value) noexcept
+    {
+        Cell* cell;
+        size_t pos = fDequeuePos.load(std::memory_order_relaxed);
+
+        while (true) {
+            cell = &fCells[pos & (Capacity - 1)];
+            const size_t seq = cell->sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+
+            if (diff == 0) {
+                if (fDequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = fDequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        value = cell->value;
+        cell->sequence.store(pos + Capacity, std::memory_order_release);
+
+        return true;
+    }
+
+    static size_t capacity() noexcept
+    {
+        return Capacity;
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T                   value;
+    };
+
+    // Padding keeps producer and consumer positions on separate cache lines,
+    // alignas() is avoided because C++11 new ignores extended alignment.
+    Cell                fCells[Capacity];
+    char                fPad0[64];
+    std::atomic<size_t> fEnqueuePos;
+    char                fPad1[64];
+    std::atomic<size_t> fDequeuePos;
+
+};
+
+END_NAMESPACE_DISTRHO
+
+#endif  // LOCK_FREE_QUEUE_HPP
@@ -0,0 +1,128 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstdint>
+
+#include "src/DistrhoDefines.h"
+
+#if defined(DISTRHO_OS_WINDOWS)
+# define WIN32_LEAN_AND_MEAN
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
+START_NAMESPACE_DISTRHO
+
+// Read-only view of a file backed by a private memory mapping. Pages are
+// copy-on-write so consumers that patch the buffer in place never modify the
+// file on disk nor affect other mappings of the same file.
+
+class MappedFile
+{
+public:
+    MappedFile(const char* path) noexcept
+        : fData(nullptr)
+        , fSize(0)
+    {
+#if defined(DISTRHO_OS_WINDOWS)
+        HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                    FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+
+        LARGE_INTEGER size;
+        HANDLE mapping = nullptr;
+
+        if (GetFileSizeEx(file, &size) && (size.QuadPart > 0)) {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+        }
+
+        if (mapping != nullptr) {
+            fData = static_cast<uint8_t*>(MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0));
+            fSize = fData != nullptr ? static_cast<size_t>(size.QuadPart) : 0;
+            CloseHandle(mapping); // view keeps a reference
+        }
+
+        CloseHandle(file);
+#else
+        const int fd = ::open(path, O_RDONLY);
+        if (fd == -1) {
+            return;
+        }
+
+        struct stat st;
+
+        if ((::fstat(fd, &st) == 0) && (st.st_size > 0)) {
+            void* ptr = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+            if (ptr != MAP_FAILED) {
+                fData = static_cast<uint8_t*>(ptr);
+                fSize = static_cast<size_t>(st.st_size);
+            }
+        }
+
+        ::close(fd); // mapping keeps a reference
+#endif
+    }
+
+    ~MappedFile()
+    {
+        if (fData == nullptr) {
+            return;
+        }
+#if defined(DISTRHO_OS_WINDOWS)
+        UnmapViewOfFile(fData);
+#else
+        ::munmap(fData, fSize);
+#endif
+    }
+
+    bool isValid() const noexcept
+    {
+        return fData != nullptr;
+    }
+
+    uint8_t* getData() const noexcept
+    {
+        return fData;
+    }
+
+    size_t getSize() const noexcept
+    {
+        return fSize;
+    }
+
+private:
+    uint8_t* fData;
+    size_t   fSize;
+
+    DISTRHO_DECLARE_NON_COPYABLE(MappedFile)
+
+};
+
+END_NAMESPACE_DISTRHO
+
+#endif  // MAPPED_FILE_HPP
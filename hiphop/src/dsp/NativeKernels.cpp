@@ -0,0 +1,495 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <exception>
+#include <utility>
+
+#if defined(__SSE2__)
+# include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+# include <arm_neon.h>
+#endif
+
+#include "NativeKernels.hpp"
+#include "CpuFeatures.hpp"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+# define HAVE_AVX2_KERNELS
+# define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+
+USE_NAMESPACE_DISTRHO
+
+typedef float32_t (*DotFunc)(const float32_t* a, const float32_t* b, size_t count);
+typedef void (*ButterflyFunc)(float32_t* a, float32_t* b, const float32_t* w, size_t count);
+typedef void (*ComplexMacFunc)(float32_t* dst, const float32_t* a, const float32_t* b, size_t count);
+
+struct NativeKernels::Ops
+{
+    const char*    name;
+    DotFunc        dot;
+    ButterflyFunc  butterflies;  // t = b * w; b = a - t; a = a + t
+    ComplexMacFunc complexMac;   // dst += a * b
+};
+
+// Scalar versions, also used for the tail of the vectorized loops
+
+static float32_t dotScalar(const float32_t* a, const float32_t* b, size_t count)
+{
+    float32_t sum = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        sum += a[i] * b[i];
+    }
+
+    return sum;
+}
+
+static void butterfliesScalar(float32_t* a, float32_t* b, const float32_t* w, size_t count)
+{
+    for (size_t i = 0; i < 2 * count; i += 2) {
+        const float32_t tr = b[i] * w[i] - b[i + 1] * w[i + 1];
+        const float32_t ti = b[i] * w[i + 1] + b[i + 1] * w[i];
+        b[i]     = a[i] - tr;
+        b[i + 1] = a[i + 1] - ti;
+        a[i]     += tr;
+        a[i + 1] += ti;
+    }
+}
+
+static void complexMacScalar(float32_t* dst, const float32_t* a, const float32_t* b, size_t count)
+{
+    for (size_t i = 0; i < 2 * count; i += 2) {
+        dst[i]     += a[i] * b[i] - a[i + 1] * b[i + 1];
+        dst[i + 1] += a[i] * b[i + 1] + a[i + 1] * b[i];
+    }
+}
+
+#if defined(__SSE2__)
+
+// Two interleaved complex values per register
+
+static inline __m128 complexMulSse(__m128 a, __m128 b)
+{
+    const __m128 br = _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 2, 0, 0));
+    const __m128 bi = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 3, 1, 1));
+    const __m128 as = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+    const __m128 negRe = _mm_set_ps(0.f, -0.f, 0.f, -0.f);
+
+    return _mm_add_ps(_mm_mul_ps(a, br), _mm_xor_ps(_mm_mul_ps(as, bi), negRe));
+}
+
+static float32_t dotSse(const float32_t* a, const float32_t* b, size_t count)
+{
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+
+    float32_t sum[4];
+    _mm_storeu_ps(sum, _mm_add_ps(acc0, acc1));
+
+    return sum[0] + sum[1] + sum[2] + sum[3] + dotScalar(a + i, b + i, count - i);
+}
+
+static void butterfliesSse(float32_t* a, float32_t* b, const float32_t* w, size_t count)
+{
+    size_t i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        const __m128 va = _mm_loadu_ps(a + 2 * i);
+        const __m128 t = complexMulSse(_mm_loadu_ps(b + 2 * i), _mm_loadu_ps(w + 2 * i));
+        _mm_storeu_ps(b + 2 * i, _mm_sub_ps(va, t));
+        _mm_storeu_ps(a + 2 * i, _mm_add_ps(va, t));
+    }
+
+    butterfliesScalar(a + 2 * i, b + 2 * i, w + 2 * i, count - i);
+}
+
+static void complexMacSse(float32_t* dst, const float32_t* a, const float32_t* b, size_t count)
+{
+    size_t i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        const __m128 t = complexMulSse(_mm_loadu_ps(a + 2 * i), _mm_loadu_ps(b + 2 * i));
+        _mm_storeu_ps(dst + 2 * i, _mm_add_ps(_mm_loadu_ps(dst + 2 * i), t));
+    }
+
+    complexMacScalar(dst + 2 * i, a + 2 * i, b + 2 * i, count - i);
+}
+
+#endif // __SSE2__
+
+#if defined(HAVE_AVX2_KERNELS)
+
+// Four interleaved complex values per register
+
+TARGET_AVX2
+static inline __m256 complexMulAvx2(__m256 a, __m256 b)
+{
+    const __m256 br = _mm256_moveldup_ps(b);
+    const __m256 bi = _mm256_movehdup_ps(b);
+    const __m256 as = _mm256_permute_ps(a, _MM_SHUFFLE(2, 3, 0, 1));
+
+    return _mm256_fmaddsub_ps(a, br, _mm256_mul_ps(as, bi));
+}
+
+TARGET_AVX2
+static float32_t dotAvx2(const float32_t* a, const float32_t* b, size_t count)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+
+    const __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    float32_t sum[4];
+    _mm_storeu_ps(sum, sum4);
+
+    return sum[0] + sum[1] + sum[2] + sum[3] + dotScalar(a + i, b + i, count - i);
+}
+
+TARGET_AVX2
+static void butterfliesAvx2(float32_t* a, float32_t* b, const float32_t* w, size_t count)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        const __m256 va = _mm256_loadu_ps(a + 2 * i);
+        const __m256 t = complexMulAvx2(_mm256_loadu_ps(b + 2 * i), _mm256_loadu_ps(w + 2 * i));
+        _mm256_storeu_ps(b + 2 * i, _mm256_sub_ps(va, t));
+        _mm256_storeu_ps(a + 2 * i, _mm256_add_ps(va, t));
+    }
+
+    butterfliesScalar(a + 2 * i, b + 2 * i, w + 2 * i, count - i);
+}
+
+TARGET_AVX2
+static void complexMacAvx2(float32_t* dst, const float32_t* a, const float32_t* b, size_t count)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        const __m256 t = complexMulAvx2(_mm256_loadu_ps(a + 2 * i), _mm256_loadu_ps(b + 2 * i));
+        _mm256_storeu_ps(dst + 2 * i, _mm256_add_ps(_mm256_loadu_ps(dst + 2 * i), t));
+    }
+
+    complexMacScalar(dst + 2 * i, a + 2 * i, b + 2 * i, count - i);
+}
+
+#endif // HAVE_AVX2_KERNELS
+
+#if defined(__aarch64__)
+
+// Four complex values per register pair, split into real and imaginary parts
+
+static float32_t dotNeon(const float32_t* a, const float32_t* b, size_t count)
+{
+    float32x4_t acc = vdupq_n_f32(0);
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        acc = vfmaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+
+    return vaddvq_f32(acc) + dotScalar(a + i, b + i, count - i);
+}
+
+static void butterfliesNeon(float32_t* a, float32_t* b, const float32_t* w, size_t count)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        const float32x4x2_t va = vld2q_f32(a + 2 * i);
+        const float32x4x2_t vb = vld2q_f32(b + 2 * i);
+        const float32x4x2_t vw = vld2q_f32(w + 2 * i);
+        const float32x4_t tr = vfmsq_f32(vmulq_f32(vb.val[0], vw.val[0]), vb.val[1], vw.val[1]);
+        const float32x4_t ti = vfmaq_f32(vmulq_f32(vb.val[1], vw.val[0]), vb.val[0], vw.val[1]);
+        float32x4x2_t r;
+        r.val[0] = vsubq_f32(va.val[0], tr);
+        r.val[1] = vsubq_f32(va.val[1], ti);
+        vst2q_f32(b + 2 * i, r);
+        r.val[0] = vaddq_f32(va.val[0], tr);
+        r.val[1] = vaddq_f32(va.val[1], ti);
+        vst2q_f32(a + 2 * i, r);
+    }
+
+    butterfliesScalar(a + 2 * i, b + 2 * i, w + 2 * i, count - i);
+}
+
+static void complexMacNeon(float32_t* dst, const float32_t* a, const float32_t* b, size_t count)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        const float32x4x2_t va = vld2q_f32(a + 2 * i);
+        const float32x4x2_t vb = vld2q_f32(b + 2 * i);
+        float32x4x2_t vd = vld2q_f32(dst + 2 * i);
+        vd.val[0] = vfmaq_f32(vd.val[0], va.val[0], vb.val[0]);
+        vd.val[0] = vfmsq_f32(vd.val[0], va.val[1], vb.val[1]);
+        vd.val[1] = vfmaq_f32(vd.val[1], va.val[0], vb.val[1]);
+        vd.val[1] = vfmaq_f32(vd.val[1], va.val[1], vb.val[0]);
+        vst2q_f32(dst + 2 * i, vd);
+    }
+
+    complexMacScalar(dst + 2 * i, a + 2 * i, b + 2 * i, count - i);
+}
+
+#endif // __aarch64__
+
+const NativeKernels::Ops& NativeKernels::getOps() noexcept
+{
+#if defined(HAVE_AVX2_KERNELS)
+    static const Ops avx2 = { "avx2", dotAvx2, butterfliesAvx2, complexMacAvx2 };
+    static const bool hasAvx2 = CpuFeatures::hasAvx2();
+
+    if (hasAvx2) {
+        return avx2;
+    }
+#endif
+#if defined(__SSE2__)
+    static const Ops sse = { "sse2", dotSse, butterfliesSse, complexMacSse };
+    return sse;
+#elif defined(__aarch64__)
+    static const Ops neon = { "neon", dotNeon, butterfliesNeon, complexMacNeon };
+    return neon;
+#else
+    static const Ops scalar = { "scalar", dotScalar, butterfliesScalar, complexMacScalar };
+    return scalar;
+#endif
+}
+
+NativeKernels::NativeKernels(WasmRuntime& runtime) noexcept
+    : fRuntime(runtime)
+    , fOps(&getOps())
+{}
+
+void NativeKernels::addHostFunctions(WasmFunctionMap& hostFunctions)
+{
+    hostFunctions["native_fft_prepare"] = MakeHostFunction(NativeKernels::hostFftPrepare, this);
+    hostFunctions["native_fft"] = MakeHostFunction(NativeKernels::hostFft, this);
+    hostFunctions["native_fir"] = MakeHostFunction(NativeKernels::hostFir, this);
+    hostFunctions["native_complex_mac"] = MakeHostFunction(NativeKernels::hostComplexMac, this);
+    hostFunctions["native_polyphase"] = MakeHostFunction(NativeKernels::hostPolyphase, this);
+}
+
+const char* NativeKernels::getInstructionSet() noexcept
+{
+    return getOps().name;
+}
+
+bool NativeKernels::hostFftPrepare(int32_t log2Size)
+{
+    if ((log2Size < 1) || (log2Size > MAX_FFT_LOG2_SIZE)) {
+        return false;
+    }
+
+    FftPlan& plan = fFftPlans[log2Size];
+
+    if (! plan.reversal.empty()) {
+        return true;
+    }
+
+    const uint32_t size = 1u << log2Size;
+    const double kPi = 3.14159265358979323846;
+
+    try {
+        // Stage with half size h uses exp(-2*pi*i*k/2h) for k in [0, h),
+        // stored at offset 2 * (h - 1)
+        plan.forward.resize(2 * (size - 1));
+        plan.inverse.resize(2 * (size - 1));
+        plan.reversal.resize(size);
+    } catch (const std::exception&) {
+        plan = FftPlan();
+        return false;
+    }
+
+    for (uint32_t h = 1; h < size; h <<= 1) {
+        for (uint32_t k = 0; k < h; ++k) {
+            const double angle = -kPi * k / h;
+            const size_t j = 2 * (h - 1 + k);
+            plan.forward[j]     = static_cast<float32_t>(std::cos(angle));
+            plan.forward[j + 1] = static_cast<float32_t>(std::sin(angle));
+            plan.inverse[j]     = plan.forward[j];
+            plan.inverse[j + 1] = -plan.forward[j + 1];
+        }
+    }
+
+    for (uint32_t i = 0; i < size; ++i) {
+        uint32_t r = 0;
+
+        for (int32_t bit = 0; bit < log2Size; ++bit) {
+            r |= ((i >> bit) & 1u) << (log2Size - 1 - bit);
+        }
+
+        plan.reversal[i] = r;
+    }
+
+    return true;
+}
+
+bool NativeKernels::hostFft(uint32_t wData, int32_t log2Size, bool inverse)
+{
+    if ((log2Size < 1) || (log2Size > MAX_FFT_LOG2_SIZE) || fFftPlans[log2Size].reversal.empty()) {
+        return false;
+    }
+
+    const FftPlan& plan = fFftPlans[log2Size];
+    const uint32_t size = 1u << log2Size;
+    float32_t* data = getFloats(wData, 2 * static_cast<size_t>(size));
+
+    if (data == nullptr) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < size; ++i) {
+        const uint32_t r = plan.reversal[i];
+
+        if (r > i) {
+            std::swap(data[2 * i], data[2 * r]);
+            std::swap(data[2 * i + 1], data[2 * r + 1]);
+        }
+    }
+
+    const float32_t* twiddles = inverse ? plan.inverse.data() : plan.forward.data();
+
+    for (uint32_t h = 1; h < size; h <<= 1) {
+        const float32_t* w = twiddles + 2 * (h - 1);
+
+        for (uint32_t g = 0; g < size; g += 2 * h) {
+            fOps->butterflies(data + 2 * g, data + 2 * (g + h), w, h);
+        }
+    }
+
+    if (inverse) {
+        const float32_t scale = 1.f / size;
+
+        for (size_t i = 0; i < 2 * static_cast<size_t>(size); ++i) {
+            data[i] *= scale;
+        }
+    }
+
+    return true;
+}
+
+bool NativeKernels::hostFir(uint32_t wDst, uint32_t wSrc, int32_t frames, uint32_t wCoeffs, int32_t taps)
+{
+    if ((frames < 0) || (taps < 1)) {
+        return false;
+    }
+
+    float32_t* dst = getFloats(wDst, frames);
+    const float32_t* src = getFloats(wSrc, static_cast<size_t>(frames) + taps - 1);
+    const float32_t* coeffs = getFloats(wCoeffs, taps);
+
+    if ((dst == nullptr) || (src == nullptr) || (coeffs == nullptr)) {
+        return false;
+    }
+
+    // In place filtering is allowed, dst[i] only depends on src[j >= i]
+    for (int32_t i = 0; i < frames; ++i) {
+        dst[i] = fOps->dot(src + i, coeffs, taps);
+    }
+
+    return true;
+}
+
+bool NativeKernels::hostComplexMac(uint32_t wDst, uint32_t wA, uint32_t wB, int32_t count)
+{
+    if (count < 0) {
+        return false;
+    }
+
+    float32_t* dst = getFloats(wDst, 2 * static_cast<size_t>(count));
+    const float32_t* a = getFloats(wA, 2 * static_cast<size_t>(count));
+    const float32_t* b = getFloats(wB, 2 * static_cast<size_t>(count));
+
+    if ((dst == nullptr) || (a == nullptr) || (b == nullptr)) {
+        return false;
+    }
+
+    fOps->complexMac(dst, a, b, count);
+
+    return true;
+}
+
+int32_t NativeKernels::hostPolyphase(uint32_t wDst, int32_t dstFrames, uint32_t wSrc, int32_t srcFrames,
+                                        uint32_t wBank, int32_t phases, int32_t taps, float64_t position,
+                                        float64_t step)
+{
+    if ((dstFrames < 0) || (srcFrames < 0) || (phases < 1) || (taps < 1)
+            || !(position >= 0) || !(step > 0)) {
+        return 0;
+    }
+
+    float32_t* dst = getFloats(wDst, dstFrames);
+    const float32_t* src = getFloats(wSrc, srcFrames);
+    const float32_t* bank = getFloats(wBank, static_cast<size_t>(phases) * taps);
+
+    if ((dst == nullptr) || (src == nullptr) || (bank == nullptr)) {
+        return 0;
+    }
+
+    int32_t i = 0;
+
+    for (; i < dstFrames; ++i) {
+        const float64_t pos = position + i * step;
+        int64_t index = static_cast<int64_t>(pos);
+        int64_t phase = static_cast<int64_t>((pos - index) * phases + 0.5);
+
+        if (phase == phases) {
+            phase = 0;
+            index++;
+        }
+
+        if (index + taps > srcFrames) {
+            break;
+        }
+
+        dst[i] = fOps->dot(src + index, bank + phase * taps, taps);
+    }
+
+    return i;
+}
+
+float32_t* NativeKernels::getFloats(uint32_t wPtr, size_t count) noexcept
+{
+    try {
+        if (! fMemory.isValid()) {
+            fMemory = fRuntime.getMemoryHandle();
+        }
+
+        const WasmValue value = MakeI32(wPtr);
+
+        return fMemory.getFloatSpan(value, count);
+    } catch (const std::exception&) {
+        // Memory is not exported yet, ie. called from the module start function
+        return nullptr;
+    }
+}
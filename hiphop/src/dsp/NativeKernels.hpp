@@ -0,0 +1,91 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef NATIVE_KERNELS_HPP
+#define NATIVE_KERNELS_HPP
+
+#include <vector>
+
+#include "WasmRuntime.hpp"
+
+#define MAX_FFT_LOG2_SIZE 20
+
+START_NAMESPACE_DISTRHO
+
+// DSP routines exposed to Wasm as host functions. They operate in place on
+// linear memory pointers passed by the module, see native_* in dpf.ts. Inner
+// loops are picked at runtime for the best SIMD instruction set available.
+// One instance per runtime, host functions never throw and validate every
+// pointer against the linear memory bounds before touching it.
+
+class NativeKernels
+{
+public:
+    NativeKernels(WasmRuntime& runtime) noexcept;
+
+    void addHostFunctions(WasmFunctionMap& hostFunctions);
+
+    static const char* getInstructionSet() noexcept;
+
+    // Not real-time safe, allocates the twiddle and bit reversal tables
+    bool hostFftPrepare(int32_t log2Size);
+
+    // In place FFT of 2^log2Size interleaved complex values. The inverse
+    // transform is scaled by 1/size.
+    bool hostFft(uint32_t wData, int32_t log2Size, bool inverse);
+
+    // dst[i] = sum(src[i + k] * coeffs[k]) for k in [0, taps), src must hold
+    // frames + taps - 1 values.
+    bool hostFir(uint32_t wDst, uint32_t wSrc, int32_t frames, uint32_t wCoeffs, int32_t taps);
+
+    // dst[i] += a[i] * b[i] for count interleaved complex values
+    bool hostComplexMac(uint32_t wDst, uint32_t wA, uint32_t wB, int32_t count);
+
+    // Reads src at position + i * step through a bank of phases filters of
+    // taps length each. Returns the number of frames written to dst, it is
+    // less than dstFrames when src runs out of samples.
+    int32_t hostPolyphase(uint32_t wDst, int32_t dstFrames, uint32_t wSrc, int32_t srcFrames,
+                            uint32_t wBank, int32_t phases, int32_t taps, float64_t position,
+                            float64_t step);
+
+private:
+    struct Ops;
+
+    static const Ops& getOps() noexcept;
+
+    float32_t* getFloats(uint32_t wPtr, size_t count) noexcept;
+
+    struct FftPlan
+    {
+        std::vector<float32_t> forward;  // twiddles for all stages, concatenated
+        std::vector<float32_t> inverse;
+        std::vector<uint32_t>  reversal;
+    };
+
+    WasmRuntime&     fRuntime;
+    WasmMemoryHandle fMemory;
+    const Ops*       fOps;
+    FftPlan          fFftPlans[MAX_FFT_LOG2_SIZE + 1];
+
+    DISTRHO_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(NativeKernels)
+
+};
+
+END_NAMESPACE_DISTRHO
+
+#endif  // NATIVE_KERNELS_HPP
@@ -108,9 +108,7 @@ void PluginEx::initState(uint32_t index, State& state)
         state.defaultValue = DISTRHO_PLUGIN_NAME;
     }
 # endif
-# if DISTRHO_PLUGIN_WANT_FULL_STATE
     fState[state.key] = state.defaultValue;
-# endif
 }
 
 void PluginEx::setState(const char* key, const char* value)
@@ -142,9 +140,7 @@ void PluginEx::setState(const char* key, const char* value)
         return;
     }
 # endif
-# if DISTRHO_PLUGIN_WANT_FULL_STATE
     fState[String(key)] = value;
-# endif
 }
 
 # if DISTRHO_PLUGIN_WANT_FULL_STATE
@@ -20,21 +20,78 @@
 #define SPIN_LOCK_HPP
 
 #include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#if defined(__i386__) || defined(__x86_64__)
+# include <immintrin.h>
+#endif
 
 #include "src/DistrhoDefines.h"
 
 START_NAMESPACE_DISTRHO
 
+struct SpinLockStats
+{
+    uint32_t contentions;      // lock() calls that had to wait
+    uint32_t tryLockFailures;  // tryLock() calls that did not acquire
+    uint64_t maxWaitNs;        // longest wait in lock()
+};
+
+// lock() backs off exponentially and then yields, it is meant for non
+// real-time threads. Real-time threads should call tryLock() and skip work
+// when the lock is taken.
+
 class SpinLock
 {
 public:
     SpinLock() noexcept
         : fFlag(false)
+        , fContentions(0)
+        , fTryLockFailures(0)
+        , fMaxWaitNs(0)
     {}
 
     void lock() noexcept
     {
-        while (fFlag.test_and_set(std::memory_order_acquire));
+        if (! fFlag.test_and_set(std::memory_order_acquire)) {
+            return;
+        }
+
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        uint32_t spins = 1;
+
+        while (fFlag.test_and_set(std::memory_order_acquire)) {
+            if (spins <= kMaxSpins) {
+                for (uint32_t i = 0; i < spins; ++i) {
+                    pause();
+                }
+
+                spins <<= 1;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+
+        const uint64_t waitNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        uint64_t maxWaitNs = fMaxWaitNs.load(std::memory_order_relaxed);
+
+        while ((waitNs > maxWaitNs) && ! fMaxWaitNs.compare_exchange_weak(maxWaitNs, waitNs,
+                                                                            std::memory_order_relaxed));
+
+        fContentions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool tryLock() noexcept
+    {
+        if (fFlag.test_and_set(std::memory_order_acquire)) {
+            fTryLockFailures.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        return true;
     }
 
     void unlock() noexcept
@@ -42,8 +99,39 @@ public:
         fFlag.clear(std::memory_order_release);
     }
 
+    SpinLockStats getStats() const noexcept
+    {
+        SpinLockStats stats;
+        stats.contentions = fContentions.load(std::memory_order_relaxed);
+        stats.tryLockFailures = fTryLockFailures.load(std::memory_order_relaxed);
+        stats.maxWaitNs = fMaxWaitNs.load(std::memory_order_relaxed);
+
+        return stats;
+    }
+
+    void resetStats() noexcept
+    {
+        fContentions.store(0, std::memory_order_relaxed);
+        fTryLockFailures.store(0, std::memory_order_relaxed);
+        fMaxWaitNs.store(0, std::memory_order_relaxed);
+    }
+
 private:
-    std::atomic_flag fFlag;
+    static constexpr uint32_t kMaxSpins = 64;
+
+    static inline void pause() noexcept
+    {
+#if defined(__i386__) || defined(__x86_64__)
+        _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+
+    std::atomic_flag      fFlag;
+    std::atomic<uint32_t> fContentions;
+    std::atomic<uint32_t> fTryLockFailures;
+    std::atomic<uint64_t> fMaxWaitNs;
 
 };
 
@@ -66,6 +154,30 @@ private:
 
 };
 
+class ScopedTrySpinLock
+{
+public:
+    ScopedTrySpinLock(SpinLock& lock) noexcept
+        : fLock(lock.tryLock() ? &lock : nullptr)
+    {}
+
+    ~ScopedTrySpinLock()
+    {
+        if (fLock != nullptr) {
+            fLock->unlock();
+        }
+    }
+
+    bool isLocked() const noexcept
+    {
+        return fLock != nullptr;
+    }
+
+private:
+    SpinLock* fLock;
+
+};
+
 END_NAMESPACE_DISTRHO
 
 #endif  // SPIN_LOCK_HPP
@@ -214,6 +214,58 @@ public:
 #endif
     }
 
+    inline void wasm_module_serialize(const wasm_module_t* arg0, own wasm_byte_vec_t* arg1)
+    {
+#if defined(HIPHOP_WASM_DLL)
+        typedef void (*FuncType)(const wasm_module_t*, own wasm_byte_vec_t*);
+        DLL_SYMBOL(__FUNCTION__,FuncType)(arg0, arg1);
+#else
+        ::wasm_module_serialize(arg0, arg1);
+#endif
+    }
+
+    inline own wasm_module_t* wasm_module_deserialize(wasm_store_t* arg0, const wasm_byte_vec_t* arg1)
+    {
+#if defined(HIPHOP_WASM_DLL)
+        typedef own wasm_module_t* (*FuncType)(wasm_store_t*, const wasm_byte_vec_t*);
+        return DLL_SYMBOL(__FUNCTION__,FuncType)(arg0, arg1);
+#else
+        return ::wasm_module_deserialize(arg0, arg1);
+#endif
+    }
+
+#if defined(HIPHOP_WASM_RUNTIME_WAMR)
+    inline own wasm_shared_module_t* wasm_module_share(wasm_module_t* arg0)
+    {
+# if defined(HIPHOP_WASM_DLL)
+        typedef own wasm_shared_module_t* (*FuncType)(wasm_module_t*);
+        return DLL_SYMBOL(__FUNCTION__,FuncType)(arg0);
+# else
+        return ::wasm_module_share(arg0);
+# endif
+    }
+
+    inline own wasm_module_t* wasm_module_obtain(wasm_store_t* arg0, wasm_shared_module_t* arg1)
+    {
+# if defined(HIPHOP_WASM_DLL)
+        typedef own wasm_module_t* (*FuncType)(wasm_store_t*, wasm_shared_module_t*);
+        return DLL_SYMBOL(__FUNCTION__,FuncType)(arg0, arg1);
+# else
+        return ::wasm_module_obtain(arg0, arg1);
+# endif
+    }
+
+    inline void wasm_shared_module_delete(own wasm_shared_module_t* arg0)
+    {
+# if defined(HIPHOP_WASM_DLL)
+        typedef void (*FuncType)(own wasm_shared_module_t*);
+        DLL_SYMBOL(__FUNCTION__,FuncType)(arg0);
+# else
+        ::wasm_shared_module_delete(arg0);
+# endif
+    }
+#endif // HIPHOP_WASM_RUNTIME_WAMR
+
     inline void wasm_module_imports(const wasm_module_t* arg0, own wasm_importtype_vec_t* arg1)
     {
 #if defined(HIPHOP_WASM_DLL)
@@ -445,6 +497,16 @@ public:
 #endif
     }
 
+    inline size_t wasm_memory_data_size(const wasm_memory_t* arg0)
+    {
+#if defined(HIPHOP_WASM_DLL)
+        typedef size_t (*FuncType)(const wasm_memory_t*);
+        return DLL_SYMBOL(__FUNCTION__,FuncType)(arg0);
+#else
+        return ::wasm_memory_data_size(arg0);
+#endif
+    }
+
     //
     // Global
     //
@@ -483,6 +545,16 @@ public:
 #endif
     }
 
+    inline void wasm_trap_delete(own wasm_trap_t* arg0)
+    {
+#if defined(HIPHOP_WASM_DLL)
+        typedef void (*FuncType)(own wasm_trap_t*);
+        DLL_SYMBOL(__FUNCTION__,FuncType)(arg0);
+#else
+        ::wasm_trap_delete(arg0);
+#endif
+    }
+
 #if defined(HIPHOP_WASM_DLL)
 private:
 # if defined(DISTRHO_OS_WINDOWS)
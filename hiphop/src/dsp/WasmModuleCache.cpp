@@ -0,0 +1,216 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+#include "src/DistrhoDefines.h"
+
+#if defined(DISTRHO_OS_WINDOWS)
+# define WIN32_LEAN_AND_MEAN
+# include <windows.h>
+#else
+# include <unistd.h>
+#endif
+
+#include "WasmModuleCache.hpp"
+#include "CpuFeatures.hpp"
+#include "extra/Path.hpp"
+#include "extra/macro.h"
+
+#if defined(HIPHOP_WASM_RUNTIME_WAMR)
+# define WASM_RUNTIME_NAME "wamr"
+#elif defined(HIPHOP_WASM_RUNTIME_WASMER)
+# define WASM_RUNTIME_NAME "wasmer"
+#endif
+
+#if defined(HIPHOP_WASM_RUNTIME_VERSION)
+# define WASM_RUNTIME_VERSION XSTR(HIPHOP_WASM_RUNTIME_VERSION)
+#else
+# define WASM_RUNTIME_VERSION "unknown"
+#endif
+
+#define CACHE_FILE_MAGIC   "HHWM"
+#define CACHE_FILE_VERSION 2
+
+USE_NAMESPACE_DISTRHO
+
+struct CacheFileHeader
+{
+    char     magic[4];
+    uint32_t version;
+    uint64_t size;
+    uint64_t hash;  // of the artifact, detects files corrupted after writing
+};
+
+static std::atomic<uint32_t> gTempFileCount(0);
+
+WasmModuleCache::WasmModuleCache(WasmCApi& lib)
+    : fLib(lib)
+{}
+
+own wasm_module_t* WasmModuleCache::load(wasm_store_t* store, const wasm_byte_vec_t* moduleBytes)
+{
+    const String path = getFilePath(moduleBytes);
+
+    if (path.isEmpty()) {
+        return fLib.wasm_module_new(store, moduleBytes);
+    }
+
+    wasm_module_t* module = read(store, path);
+
+    if (module != nullptr) {
+        return module;
+    }
+
+    module = fLib.wasm_module_new(store, moduleBytes);
+
+    if (module != nullptr) {
+        write(module, path);
+    }
+
+    return module;
+}
+
+uint64_t WasmModuleCache::hash(const byte_t* data, size_t size) noexcept
+{
+    // FNV-1a http://www.isthe.com/chongo/tech/comp/fnv/
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < size; i++) {
+        h ^= static_cast<uint8_t>(data[i]);
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+String WasmModuleCache::getFilePath(const wasm_byte_vec_t* moduleBytes)
+{
+    String path = Path::getUserData();
+
+    if (path.isEmpty()) {
+        return path;
+    }
+
+#if DISTRHO_OS_WINDOWS
+    SHCreateDirectoryExA(nullptr, path, nullptr); // no-op if already exists
+#endif
+
+    char key[32];
+    std::snprintf(key, sizeof(key), "%016llx",
+        static_cast<unsigned long long>(hash(moduleBytes->data, moduleBytes->size)));
+
+    // eg. wasm-4f2a9c0e7d3b1a65-wasmer-2.1.1-x86_64-7ffafbffbfebfbff029c67af00000000.bin
+    path += DISTRHO_OS_SEP_STR "wasm-";
+    path += key;
+    path += "-" WASM_RUNTIME_NAME "-" WASM_RUNTIME_VERSION "-";
+    path += CpuFeatures::getSignature();
+    path += ".bin";
+
+    return path;
+}
+
+own wasm_module_t* WasmModuleCache::read(wasm_store_t* store, const char* path)
+{
+    std::FILE* file = std::fopen(path, "rb");
+    if (file == nullptr) {
+        return nullptr; // cache miss
+    }
+
+    // Artifact size must match the file, do not trust it for allocation
+    long fileSize = -1;
+
+    if (std::fseek(file, 0, SEEK_END) == 0) {
+        fileSize = std::ftell(file);
+        std::rewind(file);
+    }
+
+    CacheFileHeader header;
+    wasm_module_t* module = nullptr;
+
+    if ((fileSize >= static_cast<long>(sizeof(header)))
+            && (std::fread(&header, sizeof(header), 1, file) == 1)
+            && (std::memcmp(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic)) == 0)
+            && (header.version == CACHE_FILE_VERSION)
+            && (header.size > 0)
+            && (header.size == static_cast<uint64_t>(fileSize) - sizeof(header))) {
+        wasm_byte_vec_t artifact;
+        fLib.wasm_byte_vec_new_uninitialized(&artifact, header.size);
+
+        // Deserializing trusts the artifact, it contains native code
+        if ((std::fread(artifact.data, 1, header.size, file) == header.size)
+                && (hash(artifact.data, artifact.size) == header.hash)) {
+            module = fLib.wasm_module_deserialize(store, &artifact);
+        }
+
+        fLib.wasm_byte_vec_delete(&artifact);
+    }
+
+    std::fclose(file);
+
+    if (module == nullptr) {
+        d_stderr2("Discarding invalid cached Wasm module %s", path);
+        std::remove(path);
+    }
+
+    return module;
+}
+
+void WasmModuleCache::write(const wasm_module_t* module, const char* path)
+{
+    wasm_byte_vec_t artifact;
+    std::memset(&artifact, 0, sizeof(artifact));
+    fLib.wasm_module_serialize(module, &artifact);
+
+    if (artifact.size == 0) {
+        return;
+    }
+
+    CacheFileHeader header;
+    std::memcpy(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_FILE_VERSION;
+    header.size = artifact.size;
+    header.hash = hash(artifact.data, artifact.size);
+
+    // Write to a temporary file first so concurrent instances never read a
+    // partially written artifact. The name is unique to this process and call,
+    // other processes might be writing the same artifact.
+#if defined(DISTRHO_OS_WINDOWS)
+    const unsigned long pid = GetCurrentProcessId();
+#else
+    const unsigned long pid = static_cast<unsigned long>(getpid());
+#endif
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), ".%lu-%u.tmp", pid, gTempFileCount.fetch_add(1));
+    const String tmpPath = String(path) + suffix;
+    std::FILE* file = std::fopen(tmpPath, "wb");
+
+    if (file != nullptr) {
+        const bool ok = (std::fwrite(&header, sizeof(header), 1, file) == 1)
+            && (std::fwrite(artifact.data, 1, artifact.size, file) == artifact.size);
+        std::fclose(file);
+
+        if (! ok || (std::rename(tmpPath, path) != 0)) {
+            std::remove(tmpPath);
+        }
+    }
+
+    fLib.wasm_byte_vec_delete(&artifact);
+}
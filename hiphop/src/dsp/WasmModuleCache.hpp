@@ -0,0 +1,54 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef WASM_MODULE_CACHE_HPP
+#define WASM_MODULE_CACHE_HPP
+
+#include "distrho/extra/String.hpp"
+
+#include "WasmCApi.hpp"
+
+START_NAMESPACE_DISTRHO
+
+// Persistent cache of compiled modules stored under Path::getUserData(). Keys
+// combine a hash of the module bytecode, the runtime name and version, and the
+// host CPU features. Only effective for runtimes that compile bytecode at load
+// time, WAMR AOT files are already the compiled artifact.
+
+class WasmModuleCache
+{
+public:
+    WasmModuleCache(WasmCApi& lib);
+
+    own wasm_module_t* load(wasm_store_t* store, const wasm_byte_vec_t* moduleBytes);
+
+    static uint64_t hash(const byte_t* data, size_t size) noexcept;
+
+private:
+    String getFilePath(const wasm_byte_vec_t* moduleBytes);
+
+    own wasm_module_t* read(wasm_store_t* store, const char* path);
+    void               write(const wasm_module_t* module, const char* path);
+
+    WasmCApi& fLib;
+
+};
+
+END_NAMESPACE_DISTRHO
+
+#endif  // WASM_MODULE_CACHE_HPP
@@ -0,0 +1,202 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <utility>
+
+#include "WasmModuleRegistry.hpp"
+#include "WasmModuleCache.hpp"
+#include "WasmRuntime.hpp"
+#if defined(HIPHOP_WASM_HW_BOUND_CHECK)
+# include "WasmTrapHandler.hpp"
+#endif
+
+USE_NAMESPACE_DISTRHO
+
+WasmModuleRegistry& WasmModuleRegistry::getInstance()
+{
+    static WasmModuleRegistry registry;
+    return registry;
+}
+
+WasmModuleRegistry::WasmModuleRegistry()
+    : fEngine(nullptr)
+    , fStore(nullptr)
+    , fEngineRefCount(0)
+{}
+
+WasmModuleRegistry::~WasmModuleRegistry()
+{
+    // All runtimes should be gone by now, see releaseEngine()
+    if (fEngineRefCount != 0) {
+        d_stderr2("WasmModuleRegistry : %d runtimes still alive at exit", fEngineRefCount);
+    }
+}
+
+wasm_engine_t* WasmModuleRegistry::acquireEngine()
+{
+    const MutexLocker locker(fMutex);
+
+    if (fEngine == nullptr) {
+#if defined(HIPHOP_WASM_HW_BOUND_CHECK)
+        // Runtime installs its signal handler while creating the engine
+        WasmTrapHandler::captureHostHandlers();
+#endif
+        fEngine = fLib.wasm_engine_new();
+        if (fEngine == nullptr) {
+            throw wasm_runtime_exception("wasm_engine_new() failed");
+        }
+#if defined(HIPHOP_WASM_HW_BOUND_CHECK)
+        WasmTrapHandler::install();
+#endif
+
+        // Store that owns the compiled modules
+        fStore = fLib.wasm_store_new(fEngine);
+        if (fStore == nullptr) {
+            fLib.wasm_engine_delete(fEngine);
+            fEngine = nullptr;
+            throw wasm_runtime_exception("wasm_store_new() failed");
+        }
+    }
+
+    fEngineRefCount++;
+
+    return fEngine;
+}
+
+void WasmModuleRegistry::releaseEngine()
+{
+    const MutexLocker locker(fMutex);
+
+    if (--fEngineRefCount > 0) {
+        return;
+    }
+
+    for (EntryMap::iterator it = fEntries.begin(); it != fEntries.end(); ++it) {
+#if defined(HIPHOP_WASM_RUNTIME_WAMR)
+        fLib.wasm_shared_module_delete(it->second.shared);
+#endif
+        fLib.wasm_module_delete(it->second.module);
+    }
+
+    fEntries.clear();
+
+    fLib.wasm_store_delete(fStore);
+    fStore = nullptr;
+    fLib.wasm_engine_delete(fEngine);
+    fEngine = nullptr;
+#if defined(HIPHOP_WASM_HW_BOUND_CHECK)
+    WasmTrapHandler::uninstall();
+#endif
+}
+
+own wasm_module_t* WasmModuleRegistry::acquireModule(wasm_store_t* store, const wasm_byte_vec_t* moduleBytes,
+                                                        uint64_t* key, MappedFile* file)
+{
+    const MutexLocker locker(fMutex);
+
+    const uint64_t moduleKey = WasmModuleCache::hash(moduleBytes->data, moduleBytes->size);
+    EntryMap::iterator it = fEntries.find(moduleKey);
+
+    if (it == fEntries.end()) {
+        Entry entry;
+        entry.module = compileModule(moduleBytes, file);
+        entry.refCount = 0;
+
+        if (entry.module == nullptr) {
+            delete file;
+            return nullptr;
+        }
+#if defined(HIPHOP_WASM_RUNTIME_WAMR)
+        entry.shared = fLib.wasm_module_share(entry.module);
+
+        if (entry.shared == nullptr) {
+            fLib.wasm_module_delete(entry.module);
+            delete file;
+            return nullptr;
+        }
+#endif
+        it = fEntries.insert(std::make_pair(moduleKey, entry)).first;
+    }
+
+    // Runtimes keep their own copy of the data if they need one
+    delete file;
+
+#if defined(HIPHOP_WASM_RUNTIME_WAMR)
+    // WAMR modules belong to a store, obtain a reference for the caller store
+    wasm_module_t* module = fLib.wasm_module_obtain(store, it->second.shared);
+
+    if (module == nullptr) {
+        if (it->second.refCount == 0) {
+            fLib.wasm_shared_module_delete(it->second.shared);
+            fLib.wasm_module_delete(it->second.module);
+            fEntries.erase(it);
+        }
+
+        return nullptr;
+    }
+#else
+    // Wasmer modules are bound to the engine rather than to the store that
+    // compiled them, each runtime instantiates the shared module in its own
+    // store.
+    (void)store;
+    wasm_module_t* module = it->second.module;
+#endif
+
+    it->second.refCount++;
+    *key = moduleKey;
+
+    return module;
+}
+
+void WasmModuleRegistry::releaseModule(uint64_t key, own wasm_module_t* module)
+{
+    const MutexLocker locker(fMutex);
+
+#if defined(HIPHOP_WASM_RUNTIME_WAMR)
+    fLib.wasm_module_delete(module);
+#else
+    (void)module;
+#endif
+
+    EntryMap::iterator it = fEntries.find(key);
+
+    if ((it == fEntries.end()) || (--it->second.refCount > 0)) {
+        return;
+    }
+
+#if defined(HIPHOP_WASM_RUNTIME_WAMR)
+    fLib.wasm_shared_module_delete(it->second.shared);
+#endif
+    fLib.wasm_module_delete(it->second.module);
+    fEntries.erase(it);
+}
+
+own wasm_module_t* WasmModuleRegistry::compileModule(const wasm_byte_vec_t* moduleBytes, MappedFile* file)
+{
+    if (file == nullptr) {
+        // Data owned by the caller, runtime needs to keep a copy if any
+        return fLib.wasm_module_new(fStore, moduleBytes);
+    }
+
+#if defined(HIPHOP_WASM_MODULE_CACHE)
+    return WasmModuleCache(fLib).load(fStore, moduleBytes);
+#else
+    // Compile straight from the mapped pages, WAMR keeps a single copy
+    return fLib.wasm_module_new(fStore, moduleBytes);
+#endif
+}
@@ -0,0 +1,80 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef WASM_MODULE_REGISTRY_HPP
+#define WASM_MODULE_REGISTRY_HPP
+
+#include <unordered_map>
+
+#include "distrho/extra/Mutex.hpp"
+
+#include "WasmCApi.hpp"
+#include "MappedFile.hpp"
+
+START_NAMESPACE_DISTRHO
+
+// Process-wide registry that owns a single engine and one compiled module per
+// unique binary. Plugin instances loading the same binary share the compiled
+// code and only create their own store and instance. Not real-time safe.
+
+class WasmModuleRegistry
+{
+public:
+    static WasmModuleRegistry& getInstance();
+
+    wasm_engine_t* acquireEngine();
+    void           releaseEngine();
+
+    // Return a module usable from store, release it with releaseModule(). When
+    // file is not null the registry takes ownership of it and unmaps it once
+    // the module is compiled.
+    own wasm_module_t* acquireModule(wasm_store_t* store, const wasm_byte_vec_t* moduleBytes,
+                                        uint64_t* key, MappedFile* file = nullptr);
+    void               releaseModule(uint64_t key, own wasm_module_t* module);
+
+private:
+    WasmModuleRegistry();
+    ~WasmModuleRegistry();
+
+    own wasm_module_t* compileModule(const wasm_byte_vec_t* moduleBytes, MappedFile* file);
+
+    struct Entry
+    {
+        wasm_module_t*        module;
+#if defined(HIPHOP_WASM_RUNTIME_WAMR)
+        wasm_shared_module_t* shared;
+#endif
+        int                   refCount;
+    };
+
+    typedef std::unordered_map<uint64_t, Entry> EntryMap;
+
+    WasmCApi       fLib;
+    Mutex          fMutex;
+    wasm_engine_t* fEngine;
+    wasm_store_t*  fStore;
+    int            fEngineRefCount;
+    EntryMap       fEntries;
+
+    DISTRHO_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(WasmModuleRegistry)
+
+};
+
+END_NAMESPACE_DISTRHO
+
+#endif  // WASM_MODULE_REGISTRY_HPP
@@ -16,51 +16,254 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "distrho/extra/Sleep.hpp"
 
 #include "WasmPluginImpl.hpp"
+#include "CpuFeatures.hpp"
+#include "MappedFile.hpp"
+#if defined(HIPHOP_WASM_HW_BOUND_CHECK)
+# include "WasmTrapHandler.hpp"
+#endif
 #include "extra/Path.hpp"
 
+#define WASM_BYTECODE_FILE "optimized.wasm"
+#define WASM_DESCRIPTOR_FILE "descriptor.bin"
+
 #if defined(HIPHOP_WASM_BINARY_COMPILED)
-# if defined(__arm__)
+# if defined(__arm__) || defined(__aarch64__)
 #  define WASM_BINARY_FILE "aarch64.aot"
 # else
 #  define WASM_BINARY_FILE "x86_64.aot"
 # endif
 #else
-# define WASM_BINARY_FILE "optimized.wasm"
+# define WASM_BINARY_FILE WASM_BYTECODE_FILE
 #endif
 
+// Block sizes of modules built before index.ts exported alloc_blocks()
+#define LEGACY_AUDIO_BLOCK_BYTES 65536
+#define LEGACY_MIDI_BLOCK_BYTES  1536
+
+#define DEFAULT_MIDI_BLOCK_BYTES 16384
+#define MAX_MIDI_BLOCK_BYTES     1048576
+
+// Must match DESCRIPTOR_VERSION in index.ts
+#define DESCRIPTOR_VERSION 1
+
 USE_NAMESPACE_DISTRHO
 
+// Sequential reader for the describe_plugin() table, throws when truncated
+
+class DescriptorReader
+{
+public:
+    DescriptorReader(const uint8_t* data, size_t size) noexcept
+        : fData(data)
+        , fSize(size)
+        , fOffset(0)
+    {}
+
+    uint32_t readU32()
+    {
+        uint32_t value;
+        read(&value, sizeof(value));
+        return value;
+    }
+
+    int64_t readI64()
+    {
+        int64_t value;
+        read(&value, sizeof(value));
+        return value;
+    }
+
+    float readF32()
+    {
+        float value;
+        read(&value, sizeof(value));
+        return value;
+    }
+
+    // Item count checked against the remaining bytes before allocating
+    size_t readCount(size_t minItemSize)
+    {
+        const size_t count = readU32();
+
+        if (count > (fSize - fOffset) / minItemSize) {
+            throw std::runtime_error("Plugin descriptor is truncated");
+        }
+
+        return count;
+    }
+
+    String readString()
+    {
+        const size_t size = readU32();
+        std::string value(size, '\0');
+
+        if (size > 0) {
+            read(&value[0], size);
+        }
+
+        return String(value.c_str());
+    }
+
+private:
+    void read(void* dst, size_t size)
+    {
+        if (size > fSize - fOffset) {
+            throw std::runtime_error("Plugin descriptor is truncated");
+        }
+
+        std::memcpy(dst, fData + fOffset, size);
+        fOffset += size;
+    }
+
+    const uint8_t* fData;
+    size_t         fSize;
+    size_t         fOffset;
+
+};
+
+static String getWasmBinaryPath()
+{
+    const String dir = Path::getPluginLibrary() + "/dsp/";
+#if defined(HIPHOP_WASM_AOT_VARIANTS)
+    // Prefer the most specific AOT module supported by the running CPU, see
+    // HIPHOP_WASM_AOT_VARIANTS in Makefile.plugins.mk
+    const char* variants[2] = { nullptr, nullptr };
+
+    if (CpuFeatures::hasAvx512()) {
+        variants[0] = "x86_64-avx512.aot";
+    }
+
+    if (CpuFeatures::hasAvx2()) {
+        variants[1] = "x86_64-avx2.aot";
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (variants[i] == nullptr) {
+            continue;
+        }
+
+        const String path = dir + variants[i];
+
+        if (std::FILE* file = std::fopen(path, "rb")) {
+            std::fclose(file);
+            return path;
+        }
+    }
+#endif
+    return dir + WASM_BINARY_FILE;
+}
+
 WasmPlugin::WasmPlugin(uint32_t parameterCount, uint32_t programCount, uint32_t stateCount,
                                 std::shared_ptr<WasmRuntime> runtime)
     : PluginEx(parameterCount, programCount, stateCount)
+    , fParameterCount(parameterCount)
+    , fProgramCount(programCount)
+    , fStateCount(stateCount)
+    , fPendingLoad(false)
+    , fPendingTierUp(false)
     , fActive(false)
+    , fLoaderThread(this)
+#if DISTRHO_PLUGIN_WANT_STATE
+    , fStateSerial(0)
+#endif
+    , fRuntimeFallback(kRuntimeFallbackSilence)
+    , fContentionFallback(kRuntimeFallbackRepeat)
+    , fPreviousFrames(0)
+    , fRealtimeFailed(false)
+    , fRealtimeError(nullptr)
+    , fRealtimeErrorCount(0)
+    , fDroppedMidiEventCount(0)
+    , fMidiBlockRequest(0)
+    , fParameterEvents(PARAMETER_QUEUE_SIZE)
+    , fPendingParameterEventCount(0)
+    , fQueueParameters(false)
+    , fParameterValues(new std::atomic<float>[parameterCount])
+    , fOutputParameters(new bool[parameterCount]())
+    , fMirrorOutputParameters(false)
 {   
+    for (uint32_t i = 0; i < parameterCount; ++i) {
+        fParameterValues[i].store(0, std::memory_order_relaxed);
+    }
+
+#if defined(HIPHOP_WASM_HW_BOUND_CHECK)
+    // Thread that creates the loader thread, hosts usually activate from it
+    WasmTrapHandler::initThread();
+#endif
+
     if (runtime != nullptr) {
         fRuntime = runtime;
-        return; // caller initializes runtime
+
+        // Caller initializes runtime, it might already hold an instance
+        if (fRuntime->hasInstance()) {
+            try {
+                resolveExports(*fRuntime, fExports);
+
+                if (fRuntime->hasExport("describe_plugin")) {
+                    describePlugin(*fRuntime, &fDescriptor);
+                }
+
+                loadParameterValues(*fRuntime);
+            } catch (const std::exception& ex) {
+                d_stderr2(ex.what());
+            }
+        }
+
+        return;
     }
 
     fRuntime.reset(new WasmRuntime());
 
+#if defined(HIPHOP_WASM_LAZY)
+    // Plugin scanners construct instances only to read metadata, defer loading
+    // the module until it is needed for processing or restoring state
+    if (loadDescriptorFile()) {
+        fPendingLoad = true;
+        return;
+    }
+#endif
+
     try {
-        const String path = Path::getPluginLibrary() + "/dsp/" WASM_BINARY_FILE;
-        fRuntime->load(path);
-        onModuleLoad();
+        loadModule(*fRuntime, fExports);
+
+        if (fRuntime->hasExport("describe_plugin")) {
+            describePlugin(*fRuntime, &fDescriptor);
+        }
+
+        loadParameterValues(*fRuntime);
+#if defined(HIPHOP_WASM_TIERED)
+        fPendingTierUp = true;
+#endif
     } catch (const std::exception& ex) {
         d_stderr2(ex.what());
     }
 }
 
+WasmPlugin::~WasmPlugin()
+{
+    fLoaderThread.stopThread(-1);
+}
+
 #define ERROR_STR "Error"
 #define CHECK_INSTANCE() checkInstance(__FUNCTION__)
 #define SCOPED_RUNTIME_LOCK() ScopedSpinLock lock(fRuntimeLock)
 
 const char* WasmPlugin::getLabel() const
 {
+    if (fDescriptor.valid) {
+        return fDescriptor.label.buffer();
+    }
+
     try {
         CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
@@ -75,6 +278,10 @@ const char* WasmPlugin::getLabel() const
 
 const char* WasmPlugin::getMaker() const
 {
+    if (fDescriptor.valid) {
+        return fDescriptor.maker.buffer();
+    }
+
     try {
         CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
@@ -89,6 +296,10 @@ const char* WasmPlugin::getMaker() const
 
 const char* WasmPlugin::getLicense() const
 {
+    if (fDescriptor.valid) {
+        return fDescriptor.license.buffer();
+    }
+
     try {
         CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
@@ -103,6 +314,10 @@ const char* WasmPlugin::getLicense() const
 
 uint32_t WasmPlugin::getVersion() const
 {
+    if (fDescriptor.valid) {
+        return fDescriptor.version;
+    }
+
     try {
         CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
@@ -117,6 +332,10 @@ uint32_t WasmPlugin::getVersion() const
 
 int64_t WasmPlugin::getUniqueId() const
 {
+    if (fDescriptor.valid) {
+        return fDescriptor.uniqueId;
+    }
+
     try {
         CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
@@ -138,6 +357,18 @@ void WasmPlugin::initAudioPort(const bool input, uint32_t index, AudioPort& port
 
 void WasmPlugin::initParameter(uint32_t index, Parameter& parameter)
 {
+    if (fDescriptor.valid && (index < fDescriptor.parameters.size())) {
+        const Descriptor::ParameterInfo& info = fDescriptor.parameters[index];
+        parameter.hints      = info.hints;
+        parameter.name       = info.name;
+        parameter.ranges.def = info.def;
+        parameter.ranges.min = info.min;
+        parameter.ranges.max = info.max;
+        fOutputParameters[index] = (info.hints & kParameterIsOutput) != 0;
+
+        return;
+    }
+
     try {
         CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
@@ -148,6 +379,7 @@ void WasmPlugin::initParameter(uint32_t index, Parameter& parameter)
         parameter.ranges.def = fRuntime->getGlobal("_rw_float32_0").of.f32;
         parameter.ranges.min = fRuntime->getGlobal("_rw_float32_1").of.f32;
         parameter.ranges.max = fRuntime->getGlobal("_rw_float32_2").of.f32;
+        fOutputParameters[index] = (parameter.hints & kParameterIsOutput) != 0;
     } catch (const std::exception& ex) {
         d_stderr2(ex.what());
     }
@@ -155,12 +387,16 @@ void WasmPlugin::initParameter(uint32_t index, Parameter& parameter)
 
 float WasmPlugin::getParameterValue(uint32_t index) const
 {
+    if ((index < fParameterCount) && (! fOutputParameters[index]
+            || fMirrorOutputParameters.load(std::memory_order_relaxed))) {
+        return fParameterValues[index].load(std::memory_order_relaxed);
+    }
+
     try {
         CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
 
-        return fRuntime->callFunctionReturnSingleValue("get_parameter_value",
-            { MakeI32(index) }).of.f32;
+        return fExports.getParameterValue.callReturnSingleValue({ MakeI32(index) }).of.f32;
     } catch (const std::exception& ex) {
         d_stderr2(ex.what());
 
@@ -170,11 +406,31 @@ float WasmPlugin::getParameterValue(uint32_t index) const
 
 void WasmPlugin::setParameterValue(uint32_t index, float value)
 {
+    if (index < fParameterCount) {
+        fParameterValues[index].store(value, std::memory_order_relaxed);
+    }
+
+    // Passed to the module when it gets loaded
+    if (fPendingLoad) {
+        return;
+    }
+
+    // Applied by the next run() call, DPF does not provide frame offsets
+    if (fQueueParameters.load(std::memory_order_acquire)) {
+        const ParameterEvent event = { 0, index, value };
+
+        if (fParameterQueue.push(event)) {
+            return;
+        }
+
+        // Queue is full, apply it right away
+    }
+
     try {
         CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
 
-        fRuntime->callFunction("set_parameter_value", { MakeI32(index), MakeF32(value) });
+        fExports.setParameterValue.call({ MakeI32(index), MakeF32(value) });
     } catch (const std::exception& ex) {
         d_stderr2(ex.what());
     }
@@ -183,6 +439,11 @@ void WasmPlugin::setParameterValue(uint32_t index, float value)
 #if DISTRHO_PLUGIN_WANT_PROGRAMS
 void WasmPlugin::initProgramName(uint32_t index, String& programName)
 {
+    if (fDescriptor.valid && (index < fDescriptor.programs.size())) {
+        programName = fDescriptor.programs[index];
+        return;
+    }
+
     try {
         CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
@@ -196,10 +457,12 @@ void WasmPlugin::initProgramName(uint32_t index, String& programName)
 void WasmPlugin::loadProgram(uint32_t index)
 {
     try {
+        loadPendingModule();
         CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
 
         fRuntime->callFunction("load_program", { MakeI32(index) });
+        loadParameterValues(*fRuntime);
     } catch (const std::exception& ex) {
         d_stderr2(ex.what());
     }
@@ -209,8 +472,26 @@ void WasmPlugin::loadProgram(uint32_t index)
 #if DISTRHO_PLUGIN_WANT_STATE
 void WasmPlugin::initState(uint32_t index, State& state)
 {
-    PluginEx::initState(index, state);
-    
+    {
+        // Records the default value, see replaceRuntime()
+        const MutexLocker locker(fStateMutex);
+        PluginEx::initState(index, state);
+    }
+
+    if (fDescriptor.valid) {
+        // Indices past the described states belong to PluginEx
+        if ((index < fDescriptor.states.size()) && ! fDescriptor.states[index].key.isEmpty()) {
+            const Descriptor::StateInfo& info = fDescriptor.states[index];
+            state.key          = info.key;
+            state.defaultValue = info.defaultValue;
+            state.label        = info.label;
+            state.description  = info.description;
+            state.hints        = info.hints;
+        }
+
+        return;
+    }
+
     try {
         CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
@@ -235,9 +516,14 @@ void WasmPlugin::initState(uint32_t index, State& state)
 
 void WasmPlugin::setState(const char* key, const char* value)
 {
+    // Value is recorded by PluginEx and replayed by replaceRuntime()
+    const MutexLocker locker(fStateMutex);
+
     PluginEx::setState(key, value);
+    fStateSerial++;
 
     try {
+        loadPendingModule();
         CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
 
@@ -249,11 +535,24 @@ void WasmPlugin::setState(const char* key, const char* value)
     } catch (const std::exception& ex) {
         d_stderr2(ex.what());
     }
+
+    startTierUp();
 }
 
 # if DISTRHO_PLUGIN_WANT_FULL_STATE
 String WasmPlugin::getState(const char* key) const
 {
+    // Module has not seen any state yet
+    if (fPendingLoad) {
+        for (size_t i = 0; i < fDescriptor.states.size(); ++i) {
+            if (fDescriptor.states[i].key == key) {
+                return fDescriptor.states[i].defaultValue;
+            }
+        }
+
+        return String();
+    }
+
     try {
         CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
@@ -275,28 +574,60 @@ String WasmPlugin::getState(const char* key) const
 
 void WasmPlugin::activate()
 {
+    logRealtimeErrors();
+
+    fPreviousOutput.assign(DISTRHO_PLUGIN_NUM_OUTPUTS * getBufferSize(), 0);
+    fPreviousFrames = 0;
+
+#if defined(HIPHOP_WASM_HW_BOUND_CHECK)
+    // Some hosts activate from the audio thread, prepare it outside run()
+    WasmTrapHandler::initThread();
+    // Chain a signal handler the host might have installed since
+    WasmTrapHandler::install();
+#endif
+
     try {
+        loadPendingModule();
         CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
 
+        allocateBlocks(fExports, getBufferSize());
+
+        // Sample rate and buffer size become readable from activate()
+        if (fExports.contextBlock.isValid()) {
+            writeContext(fExports, 0, 0);
+        }
+
         fRuntime->callFunction("activate");
         fActive = true;
+        fQueueParameters.store(fExports.parameterBlock.isValid(), std::memory_order_release);
     } catch (const std::exception& ex) {
         d_stderr2(ex.what());
     }
+
+    startTierUp();
+    fLoaderThread.setPolling(true);
 }
 
 void WasmPlugin::deactivate()
 {
+    fLoaderThread.setPolling(false);
+    logRealtimeErrors();
+
     try {
         CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
 
+        fQueueParameters.store(false, std::memory_order_release);
+        flushParameterQueue();
         fRuntime->callFunction("deactivate");
         fActive = false;
     } catch (const std::exception& ex) {
         d_stderr2(ex.what());
     }
+
+    // Tier-up that had to wait for the plugin to stop processing
+    fLoaderThread.publishParkedRuntime();
 }
 
 #if DISTRHO_PLUGIN_WANT_MIDI_INPUT
@@ -309,105 +640,158 @@ void WasmPlugin::deactivate()
     const MidiEvent* midiEvents = 0;
     uint32_t midiEventCount = 0;
 #endif // DISTRHO_PLUGIN_WANT_MIDI_INPUT
-    try {
-        CHECK_INSTANCE();
-        SCOPED_RUNTIME_LOCK();
+    // Real-time path, neither throws nor allocates
+    if (fRealtimeFailed.load(std::memory_order_acquire)) {
+        runFallback(fRuntimeFallback.load(), inputs, outputs, frames);
+        return;
+    }
+
+#if defined(HIPHOP_WASM_HW_BOUND_CHECK)
+    // One-off exception to the above on the first call from a thread that
+    // did not activate the plugin, see WasmTrapHandler.hpp. Done before
+    // taking the lock so other threads do not wait for it.
+    if (! WasmTrapHandler::isThreadReady()) {
+        WasmTrapHandler::initAudioThread();
+    }
+#endif
+
+    // Do not wait for other threads calling into the runtime
+    ScopedTrySpinLock lock(fRuntimeLock);
+
+    if (! lock.isLocked()) {
+        runFallback(fContentionFallback.load(), inputs, outputs, frames);
+        return;
+    }
+
+    if (! fRuntime->hasInstance() || ! fExports.run.isValid() || (fExports.blockFrames == 0)) {
+        runFallback(fRuntimeFallback.load(), inputs, outputs, frames);
+        return;
+    }
+
+    // Collect parameter changes queued since the previous call
+    const uint32_t maxParameterEvents = fExports.parameterBlock.isValid()
+        ? std::min(static_cast<uint32_t>(fParameterEvents.size()), fExports.parameterBlockSize)
+        : static_cast<uint32_t>(fParameterEvents.size());
+    const ParameterEvent* parameterEvents = fParameterEvents.data();
 
-        float32_t* audioBlock;
+    // Events a previous call could not apply go first, they are older
+    uint32_t parameterEventCount = std::min(fPendingParameterEventCount, maxParameterEvents);
+    const uint32_t pendingParameterEventCount = fPendingParameterEventCount - parameterEventCount;
 
-        audioBlock = reinterpret_cast<float32_t *>(fRuntime->getMemory(
-            fRuntime->getGlobal("_rw_input_block")));
+    while ((pendingParameterEventCount == 0) && (parameterEventCount < maxParameterEvents)
+            && fParameterQueue.pop(fParameterEvents[parameterEventCount])) {
+        parameterEventCount++;
+    }
+
+    // Hosts might exceed the maximum buffer size, for example when rendering
+    // offline. Split such calls into blocks that fit the Wasm side buffers.
+    uint32_t offset = 0;
 
-        for (int i = 0; i < DISTRHO_PLUGIN_NUM_INPUTS; i++) {
-            memcpy(audioBlock + i * frames, inputs[i], frames * 4);
+    while (offset < frames) {
+        const uint32_t blockFrames = std::min(frames - offset, fExports.blockFrames);
+        const bool last = offset + blockFrames == frames;
+        uint32_t blockMidiEventCount = 0;
+
+        while ((blockMidiEventCount < midiEventCount)
+                && (last || (midiEvents[blockMidiEventCount].frame < offset + blockFrames))) {
+            blockMidiEventCount++;
         }
 
-        byte_t* midiBlock = fRuntime->getMemory(fRuntime->getGlobal("_rw_midi_block"));
+        uint32_t blockParameterEventCount = 0;
 
-        for (uint32_t i = 0; i < midiEventCount; i++) {
-            *reinterpret_cast<uint32_t *>(midiBlock) = midiEvents[i].frame;
-            midiBlock += 4;
-            *reinterpret_cast<uint32_t *>(midiBlock) = midiEvents[i].size;
-            midiBlock += 4;
-            if (midiEvents[i].size > MidiEvent::kDataSize) {
-                memcpy(midiBlock, midiEvents[i].dataExt, midiEvents[i].size);
-            } else {
-                memcpy(midiBlock, midiEvents[i].data, midiEvents[i].size);
-            }
-            midiBlock += midiEvents[i].size;
+        while ((blockParameterEventCount < parameterEventCount)
+                && (last || (parameterEvents[blockParameterEventCount].frame < offset + blockFrames))) {
+            blockParameterEventCount++;
+        }
+
+        if (! runBlock(inputs, outputs, offset, blockFrames, midiEvents, blockMidiEventCount,
+                        parameterEvents, blockParameterEventCount)) {
+            keepParameterEvents(parameterEvents, parameterEventCount + pendingParameterEventCount);
+            runFallback(fRuntimeFallback.load(), inputs, outputs, frames);
+            return;
         }
 
-        fRuntime->callFunction("run", { MakeI32(frames), MakeI32(midiEventCount) });
+        midiEvents += blockMidiEventCount;
+        midiEventCount -= blockMidiEventCount;
+        parameterEvents += blockParameterEventCount;
+        parameterEventCount -= blockParameterEventCount;
+        offset += blockFrames;
+    }
 
-        audioBlock = reinterpret_cast<float32_t *>(fRuntime->getMemory(
-            fRuntime->getGlobal("_rw_output_block")));
+    keepParameterEvents(parameterEvents, pendingParameterEventCount);
 
+    // Keep a copy for repeating it if the next block cannot acquire the lock
+    if ((fContentionFallback.load() == kRuntimeFallbackRepeat)
+            && (DISTRHO_PLUGIN_NUM_OUTPUTS * frames <= fPreviousOutput.size())) {
         for (int i = 0; i < DISTRHO_PLUGIN_NUM_OUTPUTS; i++) {
-            memcpy(outputs[i], audioBlock + i * frames, frames * 4);
+            memcpy(fPreviousOutput.data() + i * frames, outputs[i], frames * 4);
         }
-    } catch (const std::exception& ex) {
-        //d_stderr2(ex.what());
+
+        fPreviousFrames = frames;
+    } else {
+        fPreviousFrames = 0;
     }
 }
 
 void WasmPlugin::loadWasmBinary(const uint8_t* data, size_t size)
 {
-    // No need to check if the runtime is running
-    SCOPED_RUNTIME_LOCK();
-
-    fRuntime->load(data, size);
-    onModuleLoad();
+    logRealtimeErrors();
 
-    // This has no effect on the host parameters but might be needed by the
-    // plugin code to properly initialize.
-    for (uint32_t i = 0; i < 128; ++i) {
-        fRuntime->callFunction("init_parameter", { MakeI32(i) });
-    }
+    // Compile and instantiate on a worker thread, audio keeps running on the
+    // current runtime until the new one is ready. Data is copied because the
+    // caller buffer might be overwritten in the meantime.
+    fLoaderThread.load(data, size);
+}
 
-    if (fActive) {
-        fRuntime->callFunction("activate");
-    }
+float WasmPlugin::hostGetSampleRate()
+{
+    return static_cast<float>(getSampleRate());
 }
 
-WasmValueVector WasmPlugin::getTimePosition(WasmValueVector params)
+void WasmPlugin::hostGetTimePosition()
 {
-    (void)params;
 #if DISTRHO_PLUGIN_WANT_TIMEPOS
+    // Only used by modules built without the context block. Host functions are
+    // called from Wasm, so the runtime lock is already held by the caller.
     try {
         CHECK_INSTANCE();
-        SCOPED_RUNTIME_LOCK();
 
         const TimePosition& pos = Plugin::getTimePosition();
         fRuntime->setGlobal("_rw_int32_0", MakeI32(pos.playing));
         fRuntime->setGlobal("_rw_int64_0", MakeI64(pos.frame));
-
-        return {};
     } catch (const std::exception& ex) {
         d_stderr2(ex.what());
-
-        return {};
     }
 #else
     throw std::runtime_error("Called getTimePosition() without DISTRHO_PLUGIN_WANT_TIMEPOS");
 #endif // DISTRHO_PLUGIN_WANT_TIMEPOS
 }
 
-WasmValueVector WasmPlugin::writeMidiEvent(WasmValueVector params)
+bool WasmPlugin::hostWriteMidiEvent()
 {
-    (void)params;
 #if DISTRHO_PLUGIN_WANT_MIDI_OUTPUT
+    // Only used by modules built without the MIDI output block, the runtime
+    // lock is already held by the caller. See hostGetTimePosition().
     try {
         CHECK_INSTANCE();
-        SCOPED_RUNTIME_LOCK();
 
         MidiEvent event;
-        byte_t* midiBlock = fRuntime->getMemory(fRuntime->getGlobal("_rw_midi_block"));
+        const WasmValue wPtr = fExports.midiBlock.get();
+        byte_t* midiBlock = reinterpret_cast<byte_t *>(fExports.memory.getByteSpan(wPtr, 8));
+
+        if (midiBlock == nullptr) {
+            throw std::runtime_error("MIDI block exceeds linear memory");
+        }
 
         event.frame = *reinterpret_cast<uint32_t *>(midiBlock);
         midiBlock += 4;
         event.size = *reinterpret_cast<uint32_t *>(midiBlock);
         midiBlock += 4;
 
+        if (fExports.memory.getByteSpan(wPtr, 8 + static_cast<size_t>(event.size)) == nullptr) {
+            throw std::runtime_error("MIDI event exceeds linear memory");
+        }
+
         if (event.size > MidiEvent::kDataSize) {
             event.dataExt = reinterpret_cast<uint8_t *>(midiBlock);
         } else {
@@ -415,37 +799,972 @@ WasmValueVector WasmPlugin::writeMidiEvent(WasmValueVector params)
             event.dataExt = 0;
         }
 
-        return { MakeI32(writeMidiEvent(event)) };
+        return writeMidiEvent(event);
     } catch (const std::exception& ex) {
         d_stderr2(ex.what());
 
-        return { MakeI32(0) };
+        return false;
     }
 #else
     throw std::runtime_error("Called writeMidiEvent() without DISTRHO_PLUGIN_WANT_MIDI_OUTPUT");
 #endif // DISTRHO_PLUGIN_WANT_MIDI_OUTPUT
 }
 
-void WasmPlugin::onModuleLoad()
+void WasmPlugin::describePlugin(WasmRuntime& runtime, Descriptor* descriptor)
+{
+    const WasmValue wPtr = runtime.callFunctionReturnSingleValue("describe_plugin",
+        { MakeI32(fParameterCount), MakeI32(fProgramCount), MakeI32(fStateCount) });
+
+    if (descriptor == nullptr) {
+        return;
+    }
+
+    const size_t size = static_cast<uint32_t>(runtime.getGlobal("_rw_int32_0").of.i32);
+    const uint8_t* data = runtime.getMemoryHandle().getByteSpan(wPtr, size);
+
+    if (data == nullptr) {
+        throw std::runtime_error("Plugin descriptor exceeds linear memory");
+    }
+
+    parseDescriptor(data, size, *descriptor);
+}
+
+bool WasmPlugin::loadDescriptorFile()
+{
+    const MappedFile file(Path::getPluginLibrary() + "/dsp/" WASM_DESCRIPTOR_FILE);
+
+    if (! file.isValid()) {
+        return false;
+    }
+
+    Descriptor descriptor;
+
+    try {
+        parseDescriptor(file.getData(), file.getSize(), descriptor);
+    } catch (const std::exception& ex) {
+        d_stderr2(ex.what());
+        return false;
+    }
+
+    if ((descriptor.parameters.size() != fParameterCount)
+            || (descriptor.programs.size() != fProgramCount)
+            || (descriptor.states.size() != fStateCount)) {
+        d_stderr2("Plugin descriptor counts do not match, check HIPHOP_WASM_*_COUNT");
+        return false;
+    }
+
+    fDescriptor = descriptor;
+
+    for (uint32_t i = 0; i < fParameterCount; ++i) {
+        fParameterValues[i].store(fDescriptor.parameters[i].def, std::memory_order_relaxed);
+    }
+
+    return true;
+}
+
+void WasmPlugin::parseDescriptor(const uint8_t* data, size_t size, Descriptor& descriptor)
+{
+    DescriptorReader reader(data, size);
+    Descriptor d;
+
+    if (reader.readU32() != DESCRIPTOR_VERSION) {
+        throw std::runtime_error("Unsupported plugin descriptor version");
+    }
+
+    d.version  = reader.readU32();
+    d.uniqueId = reader.readI64();
+    d.label    = reader.readString();
+    d.maker    = reader.readString();
+    d.license  = reader.readString();
+
+    d.parameters.resize(reader.readCount(20));
+
+    for (size_t i = 0; i < d.parameters.size(); ++i) {
+        Descriptor::ParameterInfo& info = d.parameters[i];
+        info.hints = reader.readU32();
+        info.def   = reader.readF32();
+        info.min   = reader.readF32();
+        info.max   = reader.readF32();
+        info.name  = reader.readString();
+    }
+
+    d.programs.resize(reader.readCount(4));
+
+    for (size_t i = 0; i < d.programs.size(); ++i) {
+        d.programs[i] = reader.readString();
+    }
+
+    d.states.resize(reader.readCount(20));
+
+    for (size_t i = 0; i < d.states.size(); ++i) {
+        Descriptor::StateInfo& info = d.states[i];
+        info.hints        = reader.readU32();
+        info.key          = reader.readString();
+        info.defaultValue = reader.readString();
+        info.label        = reader.readString();
+        info.description  = reader.readString();
+    }
+
+    d.valid = true;
+    descriptor = d;
+}
+
+void WasmPlugin::onModuleLoad(WasmRuntime& runtime, Exports& exports)
 {
     WasmFunctionMap hostFunc;
 
-    hostFunc["get_samplerate"] = { {}, { WASM_F32 }, [this](WasmValueVector) -> WasmValueVector {
-        return { MakeF32(getSampleRate()) };
-    }};
+    hostFunc["get_samplerate"] = MakeHostFunction(WasmPlugin::hostGetSampleRate, this);
+    hostFunc["get_time_position"] = MakeHostFunction(WasmPlugin::hostGetTimePosition, this);
+    hostFunc["write_midi_event"] = MakeHostFunction(WasmPlugin::hostWriteMidiEvent, this);
+
+#if defined(HIPHOP_WASM_NATIVE_KERNELS)
+    // Bound to this runtime memory, lives as long as the exports do
+    exports.kernels.reset(new NativeKernels(runtime));
+    exports.kernels->addHostFunctions(hostFunc);
+#else
+    (void)exports;
+#endif
+
+    runtime.createInstance(hostFunc);
+
+    runtime.setGlobal("_rw_num_inputs", MakeI32(DISTRHO_PLUGIN_NUM_INPUTS));
+    runtime.setGlobal("_rw_num_outputs", MakeI32(DISTRHO_PLUGIN_NUM_OUTPUTS));
+}
+
+void WasmPlugin::loadModule(WasmRuntime& runtime, Exports& exports)
+{
+#if defined(HIPHOP_WASM_TIERED)
+    // Start on the interpreter and switch to the AOT module once loaded
+    runtime.load(Path::getPluginLibrary() + "/dsp/" WASM_BYTECODE_FILE);
+#else
+    runtime.load(getWasmBinaryPath());
+#endif
+    onModuleLoad(runtime, exports);
+    resolveExports(runtime, exports);
+}
+
+void WasmPlugin::loadPendingModule()
+{
+    if (! fPendingLoad) {
+        return;
+    }
+
+    std::shared_ptr<WasmRuntime> runtime(new WasmRuntime());
+    Exports exports;
+    loadModule(*runtime, exports);
+
+    // Might be needed by the plugin code to properly initialize, metadata
+    // is already known from the descriptor file
+    if (runtime->hasExport("describe_plugin")) {
+        describePlugin(*runtime, nullptr);
+    }
+
+    {
+        SCOPED_RUNTIME_LOCK();
+
+        fRuntime.swap(runtime);
+        std::swap(fExports, exports);
+        fPendingLoad = false;
+
+        // Values set by the host before loading, or the descriptor defaults
+        for (uint32_t i = 0; i < fParameterCount; ++i) {
+            const float value = fParameterValues[i].load(std::memory_order_relaxed);
+            fExports.setParameterValue.call({ MakeI32(i), MakeF32(value) });
+        }
+    }
+
+#if defined(HIPHOP_WASM_TIERED)
+    fPendingTierUp = true;
+#endif
+}
+
+void WasmPlugin::startTierUp()
+{
+    // The loader thread replaces fRuntime and reads the recorded states, so it
+    // must not start before construction and initState() calls are done
+    if (fPendingTierUp.exchange(false)) {
+        fLoaderThread.load(getWasmBinaryPath());
+    }
+}
+
+void WasmPlugin::resolveExports(WasmRuntime& runtime, Exports& exports)
+{
+    exports.run               = runtime.getFunctionHandle("run");
+    exports.getParameterValue = runtime.getFunctionHandle("get_parameter_value");
+    exports.setParameterValue = runtime.getFunctionHandle("set_parameter_value");
+    exports.inputBlock        = runtime.getGlobalHandle("_rw_input_block");
+    exports.outputBlock       = runtime.getGlobalHandle("_rw_output_block");
+    exports.midiBlock         = runtime.getGlobalHandle("_rw_midi_block");
+    exports.memory            = runtime.getMemoryHandle();
+
+    if (runtime.hasExport("alloc_blocks")) {
+        exports.allocBlocks    = runtime.getFunctionHandle("alloc_blocks");
+        exports.allocMidiBlock = runtime.getFunctionHandle("alloc_midi_block");
+    }
+
+    if (runtime.hasExport("_rw_param_block")) {
+        exports.contextBlock       = runtime.getGlobalHandle("_rw_context_block");
+        exports.parameterBlock     = runtime.getGlobalHandle("_rw_param_block");
+        exports.parameterBlockSize = static_cast<uint32_t>(runtime.getGlobal("_ro_param_block_events").of.i32);
+    } else {
+        exports.parameterBlockSize = 0;
+    }
+
+    // GC-free modules only have room for a fixed number of events
+    exports.maxMidiEvents = runtime.hasExport("_ro_max_midi_events")
+        ? static_cast<uint32_t>(runtime.getGlobal("_ro_max_midi_events").of.i32) : UINT32_MAX;
+
+    if (runtime.hasExport("_rw_midi_out_block")) {
+        exports.midiOutputBlock = runtime.getGlobalHandle("_rw_midi_out_block");
+        exports.midiOutputCount = runtime.getGlobalHandle("_rw_midi_out_count");
+    }
+
+    if (runtime.hasExport("alloc_output_parameters")) {
+        exports.allocOutputParameters = runtime.getFunctionHandle("alloc_output_parameters");
+        exports.outputParameterBlock  = runtime.getGlobalHandle("_rw_output_param_block");
+        exports.outputParameterCount  = runtime.getGlobalHandle("_rw_output_param_count");
+    }
+
+    // Until allocateBlocks() is called. Modules allocating their own blocks
+    // have none yet, run() falls back while blockFrames is zero.
+    const int channels = std::max(1, std::max(DISTRHO_PLUGIN_NUM_INPUTS, DISTRHO_PLUGIN_NUM_OUTPUTS));
+    exports.blockFrames   = exports.allocBlocks.isValid() ? 0 : LEGACY_AUDIO_BLOCK_BYTES / (4 * channels);
+    exports.midiBlockSize = exports.allocBlocks.isValid() ? 0 : LEGACY_MIDI_BLOCK_BYTES;
+}
+
+void WasmPlugin::replaceRuntime(std::shared_ptr<WasmRuntime> runtime)
+{
+    Exports exports;
+    onModuleLoad(*runtime, exports);
+    resolveExports(*runtime, exports);
+
+    // This has no effect on the host parameters but might be needed by the
+    // plugin code to properly initialize. Host metadata cannot change after
+    // instantiation so the table returned by describe_plugin() is discarded.
+    if (runtime->hasExport("describe_plugin")) {
+        describePlugin(*runtime, nullptr);
+    } else {
+        for (uint32_t i = 0; i < 128; ++i) {
+            runtime->callFunction("init_parameter", { MakeI32(i) });
+        }
+    }
+
+    // Carry state over from the running instance
+    std::vector<uint8_t> state;
+    std::vector<float> parameters;
+#if DISTRHO_PLUGIN_WANT_STATE
+    // Later setState() calls are detected through the serial before publishing
+    StateMap states;
+    uint32_t stateSerial;
+
+    {
+        const MutexLocker locker(fStateMutex);
 
-    hostFunc["get_time_position"] = { {}, {}, 
-        std::bind(&WasmPlugin::getTimePosition, this, std::placeholders::_1)
-    };
+        states = getStateMap();
+        stateSerial = fStateSerial;
+    }
+#endif
 
-    hostFunc["write_midi_event"] = { {}, { WASM_I32 }, 
-        std::bind(&WasmPlugin::writeMidiEvent, this, std::placeholders::_1)
-    };
+    try {
+        SCOPED_RUNTIME_LOCK();
 
-    fRuntime->createInstance(hostFunc);
+        if (fPendingLoad) {
+            // Nothing to save, only parameters might have been set
+            for (uint32_t i = 0; i < fParameterCount; ++i) {
+                parameters.push_back(fParameterValues[i].load(std::memory_order_relaxed));
+            }
+        } else {
+            saveState(*fRuntime, state, parameters);
+        }
+    } catch (const std::exception& ex) {
+        // Running module might be the reason for the swap, start from defaults
+        d_stderr2(ex.what());
+        state.clear();
+        parameters.clear();
+    }
 
-    fRuntime->setGlobal("_rw_num_inputs", MakeI32(DISTRHO_PLUGIN_NUM_INPUTS));
-    fRuntime->setGlobal("_rw_num_outputs", MakeI32(DISTRHO_PLUGIN_NUM_OUTPUTS));
+    restoreState(*runtime, state, parameters);
+#if DISTRHO_PLUGIN_WANT_STATE
+    // Modules without serialize_state() only keep states through set_state()
+    replayStates(*runtime, states);
+#endif
+    allocateBlocks(exports, getBufferSize());
+
+    bool active = fActive.load();
+
+    if (active) {
+        if (exports.contextBlock.isValid()) {
+            writeContext(exports, 0, 0);
+        }
+
+        runtime->callFunction("activate");
+    }
+
+    {
+#if DISTRHO_PLUGIN_WANT_STATE
+        // Held until published so no further setState() call goes to the
+        // previous runtime only
+        const MutexLocker locker(fStateMutex);
+
+        if (fStateSerial != stateSerial) {
+            replayStates(*runtime, getStateMap());
+        }
+#endif
+        // Publishing only swaps pointers, audio thread is held for a minimum
+        SCOPED_RUNTIME_LOCK();
+
+        fRuntime.swap(runtime);
+        std::swap(fExports, exports);
+        fRealtimeFailed.store(false, std::memory_order_release);
+        fPendingLoad = false;
+
+        // Plugin (de)activated while the new runtime was being created
+        if (active != fActive.load()) {
+            active = ! active;
+
+            if (active && fExports.contextBlock.isValid()) {
+                writeContext(fExports, 0, 0);
+            }
+
+            fRuntime->callFunction(active ? "activate" : "deactivate");
+        }
+
+        if (active) {
+            fQueueParameters.store(fExports.parameterBlock.isValid(), std::memory_order_release);
+        }
+    }
+
+    // Previous runtime is released here, on the worker thread
+}
+
+void WasmPlugin::saveState(WasmRuntime& runtime, std::vector<uint8_t>& state,
+                                std::vector<float>& parameters)
+{
+    if (! runtime.hasInstance()) {
+        return;
+    }
+
+    // Modules implementing serialize_state() provide a full snapshot
+    if (runtime.hasExport("serialize_state")) {
+        const WasmValue wPtr = runtime.callFunctionReturnSingleValue("serialize_state");
+
+        if (wPtr.of.i32 != 0) {
+            const size_t size = static_cast<uint32_t>(runtime.getGlobal("_rw_int32_0").of.i32);
+            const uint8_t* data = runtime.getMemoryHandle().getByteSpan(wPtr, size);
+
+            if (data == nullptr) {
+                throw std::runtime_error("serialize_state() : state exceeds linear memory");
+            }
+
+            state.assign(data, data + size);
+
+            return;
+        }
+    }
+
+    // Otherwise keep at least the parameter values
+    for (uint32_t i = 0; i < fParameterCount; ++i) {
+        parameters.push_back(runtime.callFunctionReturnSingleValue("get_parameter_value",
+                                                                    { MakeI32(i) }).of.f32);
+    }
+}
+
+void WasmPlugin::restoreState(WasmRuntime& runtime, const std::vector<uint8_t>& state,
+                                const std::vector<float>& parameters)
+{
+    if (! state.empty() && runtime.hasExport("restore_state")) {
+        const WasmValue wPtr = runtime.callFunctionReturnSingleValue("get_state_block",
+                                                                        { MakeI32(state.size()) });
+        uint8_t* data = runtime.getMemoryHandle().getByteSpan(wPtr, state.size());
+
+        if (data == nullptr) {
+            throw std::runtime_error("restore_state() : state exceeds linear memory");
+        }
+
+        std::memcpy(data, state.data(), state.size());
+
+        if (runtime.callFunctionReturnSingleValue("restore_state").of.i32 != 0) {
+            return;
+        }
+    }
+
+    for (uint32_t i = 0; i < parameters.size(); ++i) {
+        runtime.callFunction("set_parameter_value", { MakeI32(i), MakeF32(parameters[i]) });
+    }
+}
+
+#if DISTRHO_PLUGIN_WANT_STATE
+void WasmPlugin::replayStates(WasmRuntime& runtime, const StateMap& states)
+{
+    const WasmValue wkey = runtime.getGlobal("_rw_string_0");
+    const WasmValue wval = runtime.getGlobal("_rw_string_1");
+
+    for (StateMap::const_iterator it = states.begin(); it != states.end(); ++it) {
+        // PluginEx records an empty key for states it does not own
+        if (it->first.isEmpty()) {
+            continue;
+        }
+
+        runtime.copyCStringToMemory(wkey, it->first);
+        runtime.copyCStringToMemory(wval, it->second);
+        runtime.callFunction("set_state", { wkey, wval });
+    }
+}
+#endif
+
+WasmPlugin::LoaderThread::LoaderThread(WasmPlugin* plugin) noexcept
+    : fPlugin(plugin)
+    , fPending(false)
+    , fPolling(false)
+    , fBusy(false)
+    , fPublishParked(false)
+{}
+
+void WasmPlugin::LoaderThread::load(const uint8_t* data, size_t size)
+{
+    const MutexLocker locker(fMutex);
+
+    // Only the most recent binary is relevant, a parked tier-up is outdated
+    fPendingBinary.assign(data, data + size);
+    fPendingPath.clear();
+    fPending = true;
+    fParkedRuntime.reset();
+    fPublishParked = false;
+
+    start();
+}
+
+void WasmPlugin::LoaderThread::load(const char* path)
+{
+    const MutexLocker locker(fMutex);
+
+    fPendingBinary.clear();
+    fPendingPath = path;
+    fPending = true;
+
+    start();
+}
+
+void WasmPlugin::LoaderThread::setPolling(bool polling)
+{
+    const MutexLocker locker(fMutex);
+
+    fPolling = polling;
+
+    if (polling) {
+        start();
+    }
+}
+
+void WasmPlugin::LoaderThread::publishParkedRuntime()
+{
+    const MutexLocker locker(fMutex);
+
+    if (fParkedRuntime != nullptr) {
+        fPublishParked = true;
+        start();
+    }
+}
+
+// Switching tiers while active resets voices and filters of modules that
+// cannot carry their state over, which clicks. Such a runtime is kept until
+// the plugin is deactivated, see HIPHOP_WASM_MODE in Makefile.plugins.mk.
+bool WasmPlugin::LoaderThread::park(std::shared_ptr<WasmRuntime> runtime)
+{
+    {
+        ScopedSpinLock lock(fPlugin->fRuntimeLock);
+
+        if (! fPlugin->fActive.load() || fPlugin->fRuntime->hasExport("serialize_state")) {
+            return false;
+        }
+    }
+
+    const MutexLocker locker(fMutex);
+
+    fParkedRuntime = runtime;
+
+    // deactivate() sets fActive before calling publishParkedRuntime()
+    if (! fPlugin->fActive.load()) {
+        fPublishParked = true;
+    }
+
+    return true;
+}
+
+void WasmPlugin::LoaderThread::start()
+{
+    if (! fBusy) {
+        fBusy = true;
+        stopThread(-1); // join a previous run that already returned
+        startThread();
+    }
+}
+
+void WasmPlugin::LoaderThread::run()
+{
+    std::vector<uint8_t> binary;
+    String path;
+
+#if defined(HIPHOP_WASM_HW_BOUND_CHECK)
+    WasmTrapHandler::initThread();
+#endif
+
+    while (true) {
+        std::shared_ptr<WasmRuntime> parked;
+        bool poll = false;
+
+        {
+            const MutexLocker locker(fMutex);
+
+            if (fPublishParked) {
+                parked.swap(fParkedRuntime);
+                fPublishParked = false;
+            } else if (! fPending) {
+                if (! fPolling || shouldThreadExit()) {
+                    fBusy = false;
+                    return;
+                }
+
+                poll = true;
+            } else {
+                binary.swap(fPendingBinary);
+                path = fPendingPath;
+                fPending = false;
+            }
+        }
+
+        if (poll) {
+#if defined(HIPHOP_WASM_HW_BOUND_CHECK)
+            // run() prepared a new audio thread, the runtime handler is in front
+            if (WasmTrapHandler::isInstallPending()) {
+                WasmTrapHandler::install();
+            }
+#endif
+            fPlugin->growMidiBlock();
+            fPlugin->logRealtimeErrors();
+            d_msleep(REALTIME_ERROR_POLL_MS);
+            continue;
+        }
+
+        try {
+            if (parked != nullptr) {
+                fPlugin->replaceRuntime(parked);
+                continue;
+            }
+
+            std::shared_ptr<WasmRuntime> runtime(new WasmRuntime());
+
+            if (path.isNotEmpty()) {
+                runtime->load(path);
+
+                // Tier-up, see park()
+                if (park(runtime)) {
+                    continue;
+                }
+            } else {
+                runtime->load(binary.data(), binary.size());
+            }
+
+            fPlugin->replaceRuntime(runtime);
+        } catch (const std::exception& ex) {
+            d_stderr2(ex.what());
+        }
+    }
+}
+
+void WasmPlugin::setRuntimeFallback(RuntimeFallback fallback) noexcept
+{
+    fRuntimeFallback.store(fallback);
+}
+
+void WasmPlugin::allocateBlocks(Exports& exports, uint32_t frames)
+{
+    if (exports.allocOutputParameters.isValid()) {
+        exports.allocOutputParameters.call({ MakeI32(fParameterCount) });
+    }
+
+    if (! exports.allocBlocks.isValid() || (frames == 0)) {
+        return;
+    }
+
+    exports.allocBlocks.call({ MakeI32(frames), MakeI32(DEFAULT_MIDI_BLOCK_BYTES) });
+    exports.blockFrames   = frames;
+    exports.midiBlockSize = DEFAULT_MIDI_BLOCK_BYTES;
+}
+
+void WasmPlugin::growMidiBlock()
+{
+    const uint32_t size = fMidiBlockRequest.exchange(0);
+
+    if (size == 0) {
+        return;
+    }
+
+    try {
+        SCOPED_RUNTIME_LOCK();
+
+        if (! fRuntime->hasInstance() || ! fExports.allocMidiBlock.isValid()
+                || (size <= fExports.midiBlockSize)) {
+            return;
+        }
+
+        fExports.allocMidiBlock.call({ MakeI32(size) });
+        fExports.midiBlockSize = size;
+    } catch (const std::exception& ex) {
+        d_stderr2(ex.what());
+    }
+}
+
+void WasmPlugin::flushParameterQueue()
+{
+    // Not running, events kept by run() can be accessed from this thread
+    const uint32_t pendingParameterEventCount = fPendingParameterEventCount;
+    fPendingParameterEventCount = 0;
+
+    for (uint32_t i = 0; i < pendingParameterEventCount; i++) {
+        const ParameterEvent& event = fParameterEvents[i];
+        fExports.setParameterValue.call({ MakeI32(event.index), MakeF32(event.value) });
+    }
+
+    ParameterEvent event;
+
+    while (fParameterQueue.pop(event)) {
+        fExports.setParameterValue.call({ MakeI32(event.index), MakeF32(event.value) });
+    }
+}
+
+void WasmPlugin::keepParameterEvents(const ParameterEvent* events, uint32_t count) noexcept
+{
+    // Events not delivered because of a failed block or a smaller parameter
+    // block are retried by the next call, at its first frame. The range is at
+    // or after the start of fParameterEvents so copying forward is safe.
+    ParameterEvent* pendingEvents = fParameterEvents.data();
+
+    for (uint32_t i = 0; i < count; i++) {
+        pendingEvents[i] = events[i];
+        pendingEvents[i].frame = 0;
+    }
+
+    fPendingParameterEventCount = count;
+}
+
+uint32_t WasmPlugin::getDroppedMidiEventCount() const noexcept
+{
+    return fDroppedMidiEventCount.load(std::memory_order_relaxed);
+}
+
+void WasmPlugin::loadParameterValues(WasmRuntime& runtime)
+{
+    for (uint32_t i = 0; i < fParameterCount; ++i) {
+        const float value = runtime.callFunctionReturnSingleValue("get_parameter_value",
+                                                                    { MakeI32(i) }).of.f32;
+        fParameterValues[i].store(value, std::memory_order_relaxed);
+    }
+}
+
+bool WasmPlugin::readOutputParameters() noexcept
+{
+    const uint32_t count = static_cast<uint32_t>(fExports.outputParameterCount.get().of.i32);
+
+    if (count == 0) {
+        return true;
+    }
+
+    const uint32_t* block = reinterpret_cast<const uint32_t *>(fExports.memory.getByteSpan(
+                                fExports.outputParameterBlock.get(), 8 * count));
+    if (block == nullptr) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        const uint32_t index = block[0];
+        float value;
+        memcpy(&value, block + 1, 4);
+        block += 2;
+
+        if (index < fParameterCount) {
+            fParameterValues[index].store(value, std::memory_order_relaxed);
+        }
+    }
+
+    return true;
+}
+
+bool WasmPlugin::writeContext(Exports& exports, uint32_t offset, uint32_t parameterEventCount) noexcept
+{
+    uint8_t* context = exports.memory.getByteSpan(exports.contextBlock.get(), CONTEXT_BLOCK_BYTES);
+
+    if (context == nullptr) {
+        return false;
+    }
+
+    const double   sampleRate = getSampleRate();
+    const uint32_t bufferSize = getBufferSize();
+    memset(context, 0, CONTEXT_BLOCK_BYTES);
+    memcpy(context, &sampleRate, 8);
+    memcpy(context + 8, &bufferSize, 4);
+    memcpy(context + 12, &parameterEventCount, 4);
+#if DISTRHO_PLUGIN_WANT_TIMEPOS
+    const TimePosition& pos = Plugin::getTimePosition();
+    const uint32_t playing  = pos.playing;
+    const uint32_t bbtValid = pos.bbt.valid;
+    const uint64_t frame    = pos.playing ? pos.frame + offset : pos.frame;
+    memcpy(context + 16, &playing, 4);
+    memcpy(context + 20, &bbtValid, 4);
+    memcpy(context + 24, &frame, 8);
+    memcpy(context + 32, &pos.bbt.bar, 4);
+    memcpy(context + 36, &pos.bbt.beat, 4);
+    memcpy(context + 40, &pos.bbt.tick, 8);
+    memcpy(context + 48, &pos.bbt.barStartTick, 8);
+    memcpy(context + 56, &pos.bbt.beatsPerBar, 4);
+    memcpy(context + 60, &pos.bbt.beatType, 4);
+    memcpy(context + 64, &pos.bbt.ticksPerBeat, 8);
+    memcpy(context + 72, &pos.bbt.beatsPerMinute, 8);
+#else
+    (void)offset;
+#endif
+
+    return true;
+}
+
+bool WasmPlugin::writeMidiOutput(uint32_t offset) noexcept
+{
+#if DISTRHO_PLUGIN_WANT_MIDI_OUTPUT
+    const uint32_t count = static_cast<uint32_t>(fExports.midiOutputCount.get().of.i32);
+
+    if (count == 0) {
+        return true;
+    }
+
+    // Events are frame and size followed by data, packed like the MIDI block
+    const WasmValue wPtr = fExports.midiOutputBlock.get();
+    size_t pos = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* data = fExports.memory.getByteSpan(wPtr, pos + 8);
+
+        if (data == nullptr) {
+            return false;
+        }
+
+        MidiEvent event;
+        memcpy(&event.frame, data + pos, 4);
+        memcpy(&event.size, data + pos + 4, 4);
+        pos += 8;
+
+        if (fExports.memory.getByteSpan(wPtr, pos + event.size) == nullptr) {
+            return false;
+        }
+
+        // Module frames are relative to the current block
+        event.frame += offset;
+
+        if (event.size > MidiEvent::kDataSize) {
+            event.dataExt = data + pos;
+        } else {
+            memcpy(event.data, data + pos, event.size);
+            event.dataExt = 0;
+        }
+
+        pos += event.size;
+
+        if (! writeMidiEvent(event)) {
+            break;  // host buffer is full
+        }
+    }
+#else
+    (void)offset;
+#endif
+
+    return true;
+}
+
+bool WasmPlugin::runBlock(const float** inputs, float** outputs, uint32_t offset, uint32_t frames,
+                            const MidiEvent* midiEvents, uint32_t midiEventCount,
+                            const ParameterEvent* parameterEvents, uint32_t parameterEventCount) noexcept
+{
+    float32_t* audioBlock;
+
+    audioBlock = fExports.memory.getFloatSpan(fExports.inputBlock.get(), DISTRHO_PLUGIN_NUM_INPUTS * frames);
+
+    if (audioBlock == nullptr) {
+        setRealtimeError("run() : input block exceeds linear memory");
+        return false;
+    }
+
+    for (int i = 0; i < DISTRHO_PLUGIN_NUM_INPUTS; i++) {
+        memcpy(audioBlock + i * frames, inputs[i] + offset, frames * 4);
+    }
+
+    size_t midiBlockSize = 0;
+
+    for (uint32_t i = 0; i < midiEventCount; i++) {
+        midiBlockSize += 8 + midiEvents[i].size;
+    }
+
+    // Allocating in Wasm might grow linear memory, events that do not fit are
+    // dropped and the loader thread grows the arena for the next calls. SysEx
+    // messages can be large.
+    if ((midiBlockSize > fExports.midiBlockSize) && fExports.allocMidiBlock.isValid()) {
+        const size_t wanted = std::max(midiBlockSize, 2 * static_cast<size_t>(fExports.midiBlockSize));
+        const uint32_t size = static_cast<uint32_t>(std::min(wanted, static_cast<size_t>(MAX_MIDI_BLOCK_BYTES)));
+
+        if ((size > fExports.midiBlockSize) && (size > fMidiBlockRequest.load(std::memory_order_relaxed))) {
+            fMidiBlockRequest.store(size, std::memory_order_relaxed);
+        }
+    }
+
+    byte_t* midiBlock = reinterpret_cast<byte_t *>(fExports.memory.getByteSpan(fExports.midiBlock.get(),
+                                                                        fExports.midiBlockSize));
+    if (midiBlock == nullptr) {
+        setRealtimeError("run() : MIDI block exceeds linear memory");
+        return false;
+    }
+
+    size_t midiBlockFree = fExports.midiBlockSize;
+    uint32_t midiEventsWritten = 0;
+
+    for (; midiEventsWritten < midiEventCount; midiEventsWritten++) {
+        const MidiEvent& event = midiEvents[midiEventsWritten];
+
+        if ((midiEventsWritten == fExports.maxMidiEvents) || (8 + event.size > midiBlockFree)) {
+            fDroppedMidiEventCount.fetch_add(midiEventCount - midiEventsWritten, std::memory_order_relaxed);
+            break;
+        }
+
+        *reinterpret_cast<uint32_t *>(midiBlock) = event.frame - offset;
+        midiBlock += 4;
+        *reinterpret_cast<uint32_t *>(midiBlock) = event.size;
+        midiBlock += 4;
+        if (event.size > MidiEvent::kDataSize) {
+            memcpy(midiBlock, event.dataExt, event.size);
+        } else {
+            memcpy(midiBlock, event.data, event.size);
+        }
+        midiBlock += event.size;
+        midiBlockFree -= 8 + event.size;
+    }
+
+    if (fExports.parameterBlock.isValid()) {
+        uint32_t* parameterBlock = reinterpret_cast<uint32_t *>(fExports.memory.getByteSpan(
+                                    fExports.parameterBlock.get(), 12 * parameterEventCount));
+        if (parameterBlock == nullptr) {
+            setRealtimeError("run() : parameter block exceeds linear memory");
+            return false;
+        }
+
+        for (uint32_t i = 0; i < parameterEventCount; i++) {
+            const ParameterEvent& event = parameterEvents[i];
+            parameterBlock[0] = event.frame > offset ? event.frame - offset : 0;
+            parameterBlock[1] = event.index;
+            memcpy(parameterBlock + 2, &event.value, 4);
+            parameterBlock += 3;
+        }
+    } else {
+        // Events queued before a swap to a module without parameter block
+        for (uint32_t i = 0; i < parameterEventCount; i++) {
+            fExports.setParameterValue.tryCall({ MakeI32(parameterEvents[i].index),
+                                                    MakeF32(parameterEvents[i].value) });
+        }
+    }
+
+    if (fExports.contextBlock.isValid() && ! writeContext(fExports, offset, parameterEventCount)) {
+        setRealtimeError("run() : context block exceeds linear memory");
+        return false;
+    }
+
+    if (! fExports.run.tryCall({ MakeI32(frames), MakeI32(midiEventsWritten) })) {
+        setRealtimeError("run() : wasm trap");
+        return false;
+    }
+
+    audioBlock = fExports.memory.getFloatSpan(fExports.outputBlock.get(), DISTRHO_PLUGIN_NUM_OUTPUTS * frames);
+
+    if (audioBlock == nullptr) {
+        setRealtimeError("run() : output block exceeds linear memory");
+        return false;
+    }
+
+    if (fExports.midiOutputBlock.isValid() && ! writeMidiOutput(offset)) {
+        setRealtimeError("run() : MIDI output event exceeds linear memory");
+        return false;
+    }
+
+    // Otherwise getParameterValue() reads output parameters from the module
+    fMirrorOutputParameters.store(fExports.outputParameterBlock.isValid(), std::memory_order_relaxed);
+
+    if (fExports.outputParameterBlock.isValid() && ! readOutputParameters()) {
+        setRealtimeError("run() : output parameter block exceeds linear memory");
+        return false;
+    }
+
+    for (int i = 0; i < DISTRHO_PLUGIN_NUM_OUTPUTS; i++) {
+        memcpy(outputs[i] + offset, audioBlock + i * frames, frames * 4);
+    }
+
+    return true;
+}
+
+void WasmPlugin::setContentionFallback(RuntimeFallback fallback) noexcept
+{
+    fContentionFallback.store(fallback);
+}
+
+SpinLockStats WasmPlugin::getRuntimeLockStats() const noexcept
+{
+    return fRuntimeLock.getStats();
+}
+
+void WasmPlugin::resetRuntimeLockStats() noexcept
+{
+    fRuntimeLock.resetStats();
+}
+
+void WasmPlugin::logRealtimeErrors() const
+{
+    const char* error = fRealtimeError.exchange(nullptr, std::memory_order_acquire);
+
+    if (error == nullptr) {
+        return;
+    }
+
+    const uint32_t count = fRealtimeErrorCount.exchange(0);
+
+    if (count > 1) {
+        d_stderr2("%s (%u times)", error, count);
+    } else {
+        d_stderr2("%s", error);
+    }
+}
+
+void WasmPlugin::runFallback(RuntimeFallback fallback, const float** inputs, float** outputs,
+                                uint32_t frames) noexcept
+{
+    const uint32_t previousFrames = fallback == kRuntimeFallbackRepeat
+                                    ? std::min(frames, fPreviousFrames) : 0;
+
+    for (int i = 0; i < DISTRHO_PLUGIN_NUM_OUTPUTS; i++) {
+        if ((fallback == kRuntimeFallbackBypass) && (i < DISTRHO_PLUGIN_NUM_INPUTS)) {
+            if (outputs[i] != inputs[i]) {
+                memcpy(outputs[i], inputs[i], frames * 4);
+            }
+        } else {
+            if (previousFrames > 0) {
+                memcpy(outputs[i], fPreviousOutput.data() + i * fPreviousFrames, previousFrames * 4);
+            }
+            memset(outputs[i] + previousFrames, 0, (frames - previousFrames) * 4);
+        }
+    }
+}
+
+void WasmPlugin::setRealtimeError(const char* message) noexcept
+{
+    // Stop entering the module until a new one is loaded, a trapping module
+    // would otherwise trap again on every block.
+    fRealtimeFailed.store(true, std::memory_order_release);
+    fPreviousFrames = 0; // repeating would loop the last block forever
+    fRealtimeErrorCount.fetch_add(1);
+    fRealtimeError.store(message, std::memory_order_release);
 }
 
 void WasmPlugin::checkInstance(const char* caller) const
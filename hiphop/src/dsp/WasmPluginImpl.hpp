@@ -19,20 +19,47 @@
 #ifndef WASM_PLUGIN_IMPL_HPP
 #define WASM_PLUGIN_IMPL_HPP
 
+#include <atomic>
 #include <memory>
+#include <vector>
+
+#include "distrho/extra/Mutex.hpp"
+#include "distrho/extra/Thread.hpp"
 
 #include "extra/PluginEx.hpp"
 #include "WasmRuntime.hpp"
 #include "SpinLock.hpp"
+#include "LockFreeQueue.hpp"
+#if defined(HIPHOP_WASM_NATIVE_KERNELS)
+# include "NativeKernels.hpp"
+#endif
+
+// Parameter changes that can be queued between two run() calls
+#define PARAMETER_QUEUE_SIZE 1024
+
+// Size of the per-block context written before each run() call, layout must
+// match CONTEXT_* offsets in index.ts
+#define CONTEXT_BLOCK_BYTES 80
+
+// Interval for logging errors recorded by the audio thread while active
+#define REALTIME_ERROR_POLL_MS 100
 
 START_NAMESPACE_DISTRHO
 
 class WasmPlugin : public PluginEx
 {
 public:
+    // Output produced by run() when the module cannot be called on the audio
+    // thread, either because it failed or the runtime is busy on another thread
+    enum RuntimeFallback {
+        kRuntimeFallbackSilence,
+        kRuntimeFallbackBypass,
+        kRuntimeFallbackRepeat  // previous block, for contention only
+    };
+
     WasmPlugin(uint32_t parameterCount, uint32_t programCount, uint32_t stateCount,
                     std::shared_ptr<WasmRuntime> runtime = nullptr);
-    virtual ~WasmPlugin() {}
+    virtual ~WasmPlugin();
 
     const char* getLabel() const override;
     const char* getMaker() const override;
@@ -71,17 +98,204 @@ public:
 
     void loadWasmBinary(const uint8_t* data, size_t size);
 
-    WasmValueVector getTimePosition(WasmValueVector params);
-    WasmValueVector writeMidiEvent(WasmValueVector params);
+    void setRuntimeFallback(RuntimeFallback fallback) noexcept;
+    void setContentionFallback(RuntimeFallback fallback) noexcept;
+    void logRealtimeErrors() const;
+
+    SpinLockStats getRuntimeLockStats() const noexcept;
+    void          resetRuntimeLockStats() noexcept;
+
+    uint32_t getDroppedMidiEventCount() const noexcept;
+
+    float hostGetSampleRate();
+    void  hostGetTimePosition();
+    bool  hostWriteMidiEvent();
 
 private:
-    void onModuleLoad();
+    // Exports used on the hot path, resolved once per instance
+    struct Exports
+    {
+        WasmFunctionHandle run;
+        WasmFunctionHandle getParameterValue;
+        WasmFunctionHandle setParameterValue;
+        WasmGlobalHandle   inputBlock;
+        WasmGlobalHandle   outputBlock;
+        WasmGlobalHandle   midiBlock;
+        WasmMemoryHandle   memory;
+        WasmFunctionHandle allocBlocks;
+        WasmFunctionHandle allocMidiBlock;
+        WasmGlobalHandle   contextBlock;
+        WasmGlobalHandle   midiOutputBlock;
+        WasmGlobalHandle   midiOutputCount;
+        WasmGlobalHandle   parameterBlock;
+        WasmFunctionHandle allocOutputParameters;
+        WasmGlobalHandle   outputParameterBlock;
+        WasmGlobalHandle   outputParameterCount;
+        uint32_t           blockFrames;
+        uint32_t           midiBlockSize;
+        uint32_t           maxMidiEvents;       // per run() call
+        uint32_t           parameterBlockSize;  // in events
+#if defined(HIPHOP_WASM_NATIVE_KERNELS)
+        std::shared_ptr<NativeKernels> kernels;
+#endif
+    };
+
+    // Compiles and instantiates hot-swapped or next tier modules off the audio
+    // thread. While polling it also logs errors recorded by the audio thread
+    // and grows the MIDI block when requested.
+    class LoaderThread : public Thread
+    {
+    public:
+        LoaderThread(WasmPlugin* plugin) noexcept;
+
+        void load(const uint8_t* data, size_t size);
+        void load(const char* path);
+        void setPolling(bool polling);
+        void publishParkedRuntime();
+
+    protected:
+        void run() override;
+
+    private:
+        void start();
+        bool park(std::shared_ptr<WasmRuntime> runtime);
+
+        WasmPlugin*                  fPlugin;
+        Mutex                        fMutex;
+        std::vector<uint8_t>         fPendingBinary;
+        String                       fPendingPath;
+        bool                         fPending;
+        bool                         fPolling;
+        bool                         fBusy;
+        std::shared_ptr<WasmRuntime> fParkedRuntime;  // tier-up waiting for deactivation
+        bool                         fPublishParked;
+
+    };
+
+    // Host parameter change, frame is relative to the next run() call
+    struct ParameterEvent
+    {
+        uint32_t frame;
+        uint32_t index;
+        float    value;
+    };
+
+    // Static metadata decoded once from the describe_plugin() table, see
+    // index.ts. Metadata queries are served from here when valid.
+    struct Descriptor
+    {
+        struct ParameterInfo
+        {
+            uint32_t hints;
+            float    def;
+            float    min;
+            float    max;
+            String   name;
+        };
+
+        struct StateInfo
+        {
+            uint32_t hints;
+            String   key;
+            String   defaultValue;
+            String   label;
+            String   description;
+        };
+
+        bool                       valid;
+        uint32_t                   version;
+        int64_t                    uniqueId;
+        String                     label;
+        String                     maker;
+        String                     license;
+        std::vector<ParameterInfo> parameters;
+        std::vector<String>        programs;
+        std::vector<StateInfo>     states;
+
+        Descriptor() noexcept : valid(false), version(0), uniqueId(0) {}
+    };
+
+    void onModuleLoad(WasmRuntime& runtime, Exports& exports);
+    void loadModule(WasmRuntime& runtime, Exports& exports);
+    void loadPendingModule();
+    void startTierUp();
+    void replaceRuntime(std::shared_ptr<WasmRuntime> runtime);
+    void saveState(WasmRuntime& runtime, std::vector<uint8_t>& state, std::vector<float>& parameters);
+    void restoreState(WasmRuntime& runtime, const std::vector<uint8_t>& state,
+                        const std::vector<float>& parameters);
+#if DISTRHO_PLUGIN_WANT_STATE
+    void replayStates(WasmRuntime& runtime, const StateMap& states);
+#endif
+
+    static void resolveExports(WasmRuntime& runtime, Exports& exports);
+
+    void describePlugin(WasmRuntime& runtime, Descriptor* descriptor);
+    bool loadDescriptorFile();
+
+    static void parseDescriptor(const uint8_t* data, size_t size, Descriptor& descriptor);
 
     inline void checkInstance(const char* caller) const;
 
-    bool fActive;
+    void allocateBlocks(Exports& exports, uint32_t frames);
+    void growMidiBlock();
+    void flushParameterQueue();
+    void keepParameterEvents(const ParameterEvent* events, uint32_t count) noexcept;
+    void loadParameterValues(WasmRuntime& runtime);
+    bool readOutputParameters() noexcept;
+    bool writeContext(Exports& exports, uint32_t offset, uint32_t parameterEventCount) noexcept;
+    bool writeMidiOutput(uint32_t offset) noexcept;
+    bool runBlock(const float** inputs, float** outputs, uint32_t offset, uint32_t frames,
+                    const MidiEvent* midiEvents, uint32_t midiEventCount,
+                    const ParameterEvent* parameterEvents, uint32_t parameterEventCount) noexcept;
+    void runFallback(RuntimeFallback fallback, const float** inputs, float** outputs,
+                        uint32_t frames) noexcept;
+    void setRealtimeError(const char* message) noexcept;
+
+    uint32_t                     fParameterCount;
+    uint32_t                     fProgramCount;
+    uint32_t                     fStateCount;
+    Descriptor                   fDescriptor;
+    std::atomic<bool>            fPendingLoad;  // see HIPHOP_WASM_LAZY
+    std::atomic<bool>            fPendingTierUp;  // see HIPHOP_WASM_TIERED
+    std::atomic<bool>            fActive;       // also read by the loader thread
     std::shared_ptr<WasmRuntime> fRuntime;
     mutable SpinLock             fRuntimeLock;
+    Exports                      fExports;
+    LoaderThread                 fLoaderThread;
+#if DISTRHO_PLUGIN_WANT_STATE
+    // Serializes setState() with replaceRuntime(), the serial tells whether
+    // states changed while a new runtime was being created
+    Mutex                        fStateMutex;
+    uint32_t                     fStateSerial;
+#endif
+
+    // Audio thread never throws, failures are recorded here and logged by the
+    // loader thread while active, see logRealtimeErrors(). Messages must be
+    // string literals.
+    std::atomic<RuntimeFallback>     fRuntimeFallback;
+    std::atomic<RuntimeFallback>     fContentionFallback;
+    std::vector<float>               fPreviousOutput;
+    uint32_t                         fPreviousFrames;
+    std::atomic<bool>                fRealtimeFailed;
+    mutable std::atomic<const char*> fRealtimeError;
+    mutable std::atomic<uint32_t>    fRealtimeErrorCount;
+    std::atomic<uint32_t>            fDroppedMidiEventCount;
+    std::atomic<uint32_t>            fMidiBlockRequest;  // bytes, 0 if none
+
+    // Parameter changes reach the module through run() while active, instead
+    // of entering Wasm under the runtime lock for every automation point
+    LockFreeQueue<ParameterEvent, PARAMETER_QUEUE_SIZE> fParameterQueue;
+    std::vector<ParameterEvent>                         fParameterEvents;  // audio thread
+    uint32_t                                            fPendingParameterEventCount;
+    std::atomic<bool>                                   fQueueParameters;
+
+    // Last known value of every parameter, getParameterValue() reads it from
+    // any thread without entering Wasm. Input parameters are updated by
+    // setParameterValue() and output parameters after each run() call, for
+    // modules exporting alloc_output_parameters(). Other modules are asked.
+    std::unique_ptr<std::atomic<float>[]>               fParameterValues;
+    std::unique_ptr<bool[]>                             fOutputParameters;
+    std::atomic<bool>                                   fMirrorOutputParameters;
 
     DISTRHO_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(WasmPlugin)
 
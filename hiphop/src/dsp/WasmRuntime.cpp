@@ -16,11 +16,15 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <cstdio>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 
 #include "WasmRuntime.hpp"
+#include "WasmModuleRegistry.hpp"
+#if defined(HIPHOP_WASM_HW_BOUND_CHECK)
+# include "WasmTrapHandler.hpp"
+#endif
 
 #define MAX_STRING_SIZE    1024
 #define MAX_HOST_FUNCTIONS 1024
@@ -30,20 +34,21 @@ WasmRuntime::WasmRuntime()
     , fStore(nullptr)
     , fModule(nullptr)
     , fInstance(nullptr)
+    , fModuleKey(0)
+    , fCallGeneration(1)
+    , fCallDepth(0)
 #if HIPHOP_PLUGIN_WASM_WASI
     , fWasiEnv(nullptr)
 #endif
 {
     std::memset(&fExportsVec, 0, sizeof(fExportsVec));
 
-    fEngine = fLib.wasm_engine_new();
-    if (fEngine == nullptr) {
-        throw wasm_runtime_exception("wasm_engine_new() failed");
-    }
+    // Engine is shared by all runtimes in the process
+    fEngine = WasmModuleRegistry::getInstance().acquireEngine();
 
     fStore = fLib.wasm_store_new(fEngine); 
     if (fStore == nullptr) {
-        fLib.wasm_engine_delete(fEngine);
+        WasmModuleRegistry::getInstance().releaseEngine();
         throw wasm_runtime_exception("wasm_store_new() failed");
     }
 }
@@ -54,46 +59,54 @@ WasmRuntime::~WasmRuntime()
         destroyInstance();
     }
 
+    unloadModule();
+
     if (fStore != nullptr) {
         fLib.wasm_store_delete(fStore);
         fStore = nullptr;
     }
 
     if (fEngine != nullptr) {
-        fLib.wasm_engine_delete(fEngine);
+        WasmModuleRegistry::getInstance().releaseEngine();
         fEngine = nullptr;
     }
 }
 
+// Non-owning view of caller memory, never pass it to wasm_byte_vec_delete()
+static wasm_byte_vec_t makeByteVecView(const uint8_t* data, size_t size)
+{
+    wasm_byte_vec_t vec;
+    std::memset(&vec, 0, sizeof(vec));
+    vec.size = size;
+    vec.data = reinterpret_cast<wasm_byte_t*>(const_cast<uint8_t*>(data));
+#if defined(HIPHOP_WASM_RUNTIME_WAMR)
+    vec.num_elems = size;
+    vec.size_of_elem = sizeof(wasm_byte_t);
+#endif
+    return vec;
+}
+
 void WasmRuntime::load(const char* modulePath)
 {
     if (hasInstance()) {
         destroyInstance();
     }
 
-    std::FILE* file = std::fopen(modulePath, "rb");
-    if (file == nullptr) {
-        throw wasm_module_exception("Error opening module file");
-    }
+    unloadModule();
 
-    std::fseek(file, 0L, SEEK_END);
-    const size_t fileSize = std::ftell(file);
-    std::fseek(file, 0L, SEEK_SET);
+    // Map the file instead of reading it into a temporary buffer, the registry
+    // takes ownership of the mapping and drops it after compilation.
+    MappedFile* file = new MappedFile(modulePath);
 
-    wasm_byte_vec_t moduleBytes;
-    fLib.wasm_byte_vec_new_uninitialized(&moduleBytes, fileSize);
-    
-    size_t bytesRead = std::fread(moduleBytes.data, 1, fileSize, file);
-    std::fclose(file);
-
-    if (bytesRead != fileSize) {
-        fLib.wasm_byte_vec_delete(&moduleBytes);
-        throw wasm_module_exception("Error reading module file");
+    if (! file->isValid()) {
+        delete file;
+        throw wasm_module_exception("Error opening module file");
     }
 
+    const wasm_byte_vec_t moduleBytes = makeByteVecView(file->getData(), file->getSize());
+
     // Following call crashes some DAWs on Windows when running Wasmer runtime.
-    fModule = fLib.wasm_module_new(fStore, &moduleBytes);
-    fLib.wasm_byte_vec_delete(&moduleBytes);
+    fModule = WasmModuleRegistry::getInstance().acquireModule(fStore, &moduleBytes, &fModuleKey, file);
 
     if (fModule == nullptr) {
         throw wasm_runtime_exception("wasm_module_new() failed");
@@ -106,13 +119,12 @@ void WasmRuntime::load(const uint8_t* moduleData, size_t size)
         destroyInstance();
     }
 
-    wasm_byte_vec_t moduleBytes;
-    fLib.wasm_byte_vec_new_uninitialized(&moduleBytes, size);
+    unloadModule();
 
-    std::memcpy(moduleBytes.data, moduleData, size);
+    // Runtime makes its own copy if it needs one, avoid an intermediate copy
+    const wasm_byte_vec_t moduleBytes = makeByteVecView(moduleData, size);
 
-    fModule = fLib.wasm_module_new(fStore, &moduleBytes);
-    fLib.wasm_byte_vec_delete(&moduleBytes);
+    fModule = WasmModuleRegistry::getInstance().acquireModule(fStore, &moduleBytes, &fModuleKey);
 
     if (fModule == nullptr) {
         throw wasm_runtime_exception("wasm_module_new() failed");
@@ -214,7 +226,21 @@ void WasmRuntime::createInstance(WasmFunctionMap hostFunctions)
     fHostFunctions.reserve(MAX_HOST_FUNCTIONS);
 
     for (WasmFunctionMap::const_iterator it = hostFunctions.cbegin(); it != hostFunctions.cend(); ++it) {
-        fHostFunctions.push_back(it->second.function);
+        std::unordered_map<std::string, int>::const_iterator index = importIndex.find(it->first);
+
+        if (index == importIndex.end()) {
+            continue; // optional host function not used by the module
+        }
+
+        wasm_func_callback_with_env_t callback = it->second.callback;
+        void* env = it->second.env;
+
+        if (callback == nullptr) {
+            // Generic and slower path
+            fHostFunctions.push_back(it->second.function);
+            callback = WasmRuntime::callHostFunction;
+            env = &fHostFunctions.back();
+        }
 
         wasm_valtype_vec_t params;
         toCValueTypeVector(it->second.params, &params);
@@ -222,9 +248,8 @@ void WasmRuntime::createInstance(WasmFunctionMap hostFunctions)
         toCValueTypeVector(it->second.result, &result);
 
         const wasm_functype_t* funcType = fLib.wasm_functype_new(&params, &result);
-        wasm_func_t* func = fLib.wasm_func_new_with_env(fStore, funcType, WasmRuntime::callHostFunction,
-                                                        &fHostFunctions.back(), nullptr);
-        imports.data[importIndex[it->first]] = fLib.wasm_func_as_extern(func);
+        wasm_func_t* func = fLib.wasm_func_new_with_env(fStore, funcType, callback, env, nullptr);
+        imports.data[index->second] = fLib.wasm_func_as_extern(func);
 
         fLib.wasm_valtype_vec_delete(&result);
         fLib.wasm_valtype_vec_delete(&params);
@@ -232,7 +257,14 @@ void WasmRuntime::createInstance(WasmFunctionMap hostFunctions)
 
     // Create instance and start WASI if needed
 
-    fInstance = fLib.wasm_instance_new(fStore, fModule, &imports, nullptr);
+    {
+#if defined(HIPHOP_WASM_HW_BOUND_CHECK)
+        // Module start function runs here
+        WasmTrapHandler::initThread();
+        const WasmTrapHandler::ScopedCall scopedCall;
+#endif
+        fInstance = fLib.wasm_instance_new(fStore, fModule, &imports, nullptr);
+    }
 
     fLib.wasm_extern_vec_delete(&imports);
 
@@ -267,15 +299,14 @@ void WasmRuntime::createInstance(WasmFunctionMap hostFunctions)
     }
 
     fLib.wasm_exporttype_vec_delete(&exportTypes);
+
+    if (hasExport("memory")) {
+        fMemory = getMemoryHandle("memory");
+    }
 }
 
 void WasmRuntime::destroyInstance()
 {
-    if (fModule != nullptr) {
-        fLib.wasm_module_delete(fModule);
-        fModule = nullptr;
-    }
-
 #if HIPHOP_PLUGIN_WASM_WASI
     if (fWasiEnv != nullptr) {
         wasi_env_delete(fWasiEnv);
@@ -295,13 +326,20 @@ void WasmRuntime::destroyInstance()
 
     fHostFunctions.clear();
     fModuleExports.clear();
+    fMemory = WasmMemoryHandle();
+}
+
+void WasmRuntime::unloadModule()
+{
+    if (fModule != nullptr) {
+        WasmModuleRegistry::getInstance().releaseModule(fModuleKey, fModule);
+        fModule = nullptr;
+    }
 }
 
 byte_t* WasmRuntime::getMemory(const WasmValue& wPtr)
 {
-    return fLib.wasm_memory_data(
-        fLib.wasm_extern_as_memory(fModuleExports["memory"])
-    ) + wPtr.of.i32;
+    return fMemory.getData(wPtr);
 }
 
 char* WasmRuntime::getMemoryAsCString(const WasmValue& wPtr)
@@ -333,42 +371,138 @@ char* WasmRuntime::getGlobalAsCString(const char* name)
 
 WasmValueVector WasmRuntime::callFunction(const char* name, WasmValueVector params)
 {
-    const wasm_func_t* func = fLib.wasm_extern_as_func(fModuleExports[name]);
+    const char* exportName;
+    const wasm_func_t* func = fLib.wasm_extern_as_func(findExport(name, &exportName));
 
-    // https://stackoverflow.com/questions/10078283/how-sizeofarray-works-at-runtime
-    wasm_val_t paramsArray[params.size()];
-    std::copy(params.begin(), params.end(), paramsArray);
-    wasm_val_vec_t paramsVec = WASM_ARRAY_VEC(paramsArray);
+    WasmValue result = WASM_INIT_VAL;
+    invokeFunction(func, exportName, params.data(), params.size(), &result);
 
-    wasm_val_t resultArray[1] = { WASM_INIT_VAL };
-    wasm_val_vec_t resultVec = WASM_ARRAY_VEC(resultArray);
+    return { result };
+}
 
-    const wasm_trap_t* trap = fLib.wasm_func_call(func, &paramsVec, &resultVec);
+WasmValue WasmRuntime::callFunctionReturnSingleValue(const char* name, WasmValueVector params)
+{
+    return callFunction(name, params)[0];
+}
+
+const char* WasmRuntime::callFunctionReturnCString(const char* name, WasmValueVector params)
+{
+    return getMemoryAsCString(callFunctionReturnSingleValue(name, params));
+}
+
+bool WasmRuntime::hasExport(const char* name)
+{
+    return fModuleExports.find(name) != fModuleExports.end();
+}
+
+WasmFunctionHandle WasmRuntime::getFunctionHandle(const char* name)
+{
+    WasmFunctionHandle handle;
+    handle.fRuntime = this;
+    handle.fFunc = fLib.wasm_extern_as_func(findExport(name, &handle.fName));
+
+    return handle;
+}
+
+WasmGlobalHandle WasmRuntime::getGlobalHandle(const char* name)
+{
+    WasmGlobalHandle handle;
+    handle.fRuntime = this;
+    handle.fGlobal = fLib.wasm_extern_as_global(findExport(name));
+
+    return handle;
+}
+
+WasmMemoryHandle WasmRuntime::getMemoryHandle(const char* name)
+{
+    WasmMemoryHandle handle;
+    handle.fRuntime = this;
+    handle.fMemory = fLib.wasm_extern_as_memory(findExport(name));
+
+    return handle;
+}
+
+wasm_extern_t* WasmRuntime::findExport(const char* name, const char** exportName)
+{
+    WasmExternMap::const_iterator it = fModuleExports.find(name);
+
+    if (it == fModuleExports.end()) {
+        throw wasm_module_exception(std::string("Wasm module does not export ") + name);
+    }
+
+    // Map keys are stable through the instance lifetime, handles can keep them
+    if (exportName != nullptr) {
+        *exportName = it->first.c_str();
+    }
+
+    return it->second;
+}
+
+void WasmRuntime::invokeFunction(const wasm_func_t* func, const char* name, const WasmValue* params,
+                                    size_t paramCount, WasmValue* result)
+{
+#if defined(HIPHOP_WASM_HW_BOUND_CHECK)
+    // Not a real-time path, any thread can call into Wasm from here
+    WasmTrapHandler::initThread();
+#endif
+
+    own wasm_trap_t* trap = invokeFunctionNoThrow(func, params, paramCount, result);
 
     if (trap != nullptr) {
         std::string s = std::string("Failed call to function ") + name;
 
-        wasm_message_t* wm = nullptr;
-        fLib.wasm_trap_message(trap, wm);
+        wasm_message_t wm;
+        std::memset(&wm, 0, sizeof(wm));
+        fLib.wasm_trap_message(trap, &wm);
 
-        if (wm != nullptr) {
-            s += std::string(" - trap message: ") + std::string(wm->data /*null terminated*/);
+        if (wm.size != 0) {
+            s += std::string(" - trap message: ") + std::string(wm.data /*null terminated*/);
+            fLib.wasm_byte_vec_delete(&wm);
         }
 
+        fLib.wasm_trap_delete(trap);
+
         throw wasm_runtime_exception(s);
     }
-
-    return WasmValueVector(resultVec.data, resultVec.data + resultVec.size);
 }
 
-WasmValue WasmRuntime::callFunctionReturnSingleValue(const char* name, WasmValueVector params)
+own wasm_trap_t* WasmRuntime::invokeFunctionNoThrow(const wasm_func_t* func, const WasmValue* params,
+                                                    size_t paramCount, WasmValue* result) noexcept
 {
-    return callFunction(name, params)[0];
-}
+    wasm_val_vec_t paramsVec;
+    std::memset(&paramsVec, 0, sizeof(paramsVec));
+    paramsVec.size = paramCount;
+    paramsVec.data = const_cast<WasmValue *>(params);
+#if defined(HIPHOP_WASM_RUNTIME_WAMR)
+    paramsVec.num_elems = paramCount;
+    paramsVec.size_of_elem = sizeof(WasmValue);
+#endif
 
-const char* WasmRuntime::callFunctionReturnCString(const char* name, WasmValueVector params)
-{
-    return getMemoryAsCString(callFunctionReturnSingleValue(name, params));
+    wasm_val_vec_t resultVec;
+    std::memset(&resultVec, 0, sizeof(resultVec));
+    resultVec.size = 1;
+    resultVec.data = result;
+#if defined(HIPHOP_WASM_RUNTIME_WAMR)
+    resultVec.num_elems = 1;
+    resultVec.size_of_elem = sizeof(WasmValue);
+#endif
+
+#if defined(HIPHOP_WASM_HW_BOUND_CHECK)
+    // Also called from the audio thread, see WasmTrapHandler::initThread()
+# if defined(DEBUG)
+    DISTRHO_SAFE_ASSERT(WasmTrapHandler::isThreadReady());
+# endif
+    const WasmTrapHandler::ScopedCall scopedCall;
+#endif
+
+    fCallDepth++;
+    own wasm_trap_t* trap = fLib.wasm_func_call(func, &paramsVec, &resultVec);
+    fCallDepth--;
+
+    // Memory might have grown, invalidate cached memory pointers
+    fCallGeneration++;
+
+    return trap;
 }
 
 wasm_trap_t* WasmRuntime::callHostFunction(void* env, const wasm_val_vec_t* paramsVec, wasm_val_vec_t* resultVec)
@@ -397,6 +531,116 @@ own void WasmRuntime::toCValueTypeVector(WasmValueKindVector kinds, own wasm_val
     fLib.wasm_valtype_vec_new(out, size, typesArray);
 }
 
+void WasmFunctionHandle::call(std::initializer_list<WasmValue> params) const
+{
+    callReturnSingleValue(params);
+}
+
+WasmValue WasmFunctionHandle::callReturnSingleValue(std::initializer_list<WasmValue> params) const
+{
+    if (fFunc == nullptr) {
+        throw wasm_runtime_exception("Call through unresolved function handle");
+    }
+
+    WasmValue result = WASM_INIT_VAL;
+    fRuntime->invokeFunction(fFunc, fName, params.begin(), params.size(), &result);
+
+    return result;
+}
+
+bool WasmFunctionHandle::tryCall(std::initializer_list<WasmValue> params, WasmValue* result) const noexcept
+{
+    if (fFunc == nullptr) {
+        return false;
+    }
+
+    WasmValue dummy = WASM_INIT_VAL;
+    own wasm_trap_t* trap = fRuntime->invokeFunctionNoThrow(fFunc, params.begin(), params.size(),
+                                                            result != nullptr ? result : &dummy);
+    if (trap != nullptr) {
+        fRuntime->fLib.wasm_trap_delete(trap);
+        return false;
+    }
+
+    return true;
+}
+
+const char* WasmFunctionHandle::callReturnCString(std::initializer_list<WasmValue> params) const
+{
+    return fRuntime->getMemoryAsCString(callReturnSingleValue(params));
+}
+
+WasmValue WasmGlobalHandle::get() const
+{
+    wasm_val_t value;
+    fRuntime->fLib.wasm_global_get(fGlobal, &value);
+    return value;
+}
+
+void WasmGlobalHandle::set(const WasmValue& value) const
+{
+    fRuntime->fLib.wasm_global_set(fGlobal, &value);
+}
+
+char* WasmGlobalHandle::getAsCString() const
+{
+    return fRuntime->getMemoryAsCString(get());
+}
+
+byte_t* WasmMemoryHandle::getData(const WasmValue& wPtr) const
+{
+    validate();
+    return fData + static_cast<uint32_t>(wPtr.of.i32);
+}
+
+size_t WasmMemoryHandle::getSize() const
+{
+    validate();
+    return fSize;
+}
+
+uint8_t* WasmMemoryHandle::getByteSpan(const WasmValue& wPtr, size_t size) const
+{
+    validate();
+
+    const size_t offset = static_cast<uint32_t>(wPtr.of.i32);
+
+    if ((size > fSize) || (offset > fSize - size)) {
+        return nullptr;
+    }
+
+    return reinterpret_cast<uint8_t *>(fData + offset);
+}
+
+float32_t* WasmMemoryHandle::getFloatSpan(const WasmValue& wPtr, size_t count) const
+{
+    if (count > SIZE_MAX / sizeof(float32_t)) {
+        return nullptr;
+    }
+
+    return reinterpret_cast<float32_t *>(getByteSpan(wPtr, count * sizeof(float32_t)));
+}
+
+void WasmMemoryHandle::validate() const
+{
+    WasmCApi& lib = fRuntime->fLib;
+
+    if (fGeneration == fRuntime->fCallGeneration) {
+        if (fRuntime->fCallDepth == 0) {
+            return;
+        }
+
+        // Called from a host function, Wasm code might have grown memory
+        if (lib.wasm_memory_data_size(fMemory) == fSize) {
+            return;
+        }
+    }
+
+    fData = lib.wasm_memory_data(fMemory);
+    fSize = lib.wasm_memory_data_size(fMemory);
+    fGeneration = fRuntime->fCallGeneration;
+}
+
 const char* WasmRuntime::WTF16ToCString(const WasmValue& wPtr)
 {
     if (fModuleExports.find("wtf16_to_c_string") == fModuleExports.end()) {
@@ -20,6 +20,7 @@
 #define WASM_RUNTIME_HPP
 
 #include <functional>
+#include <initializer_list>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
@@ -43,6 +44,7 @@
 
 START_NAMESPACE_DISTRHO
 
+class WasmRuntime;
 struct WasmFunctionDescriptor;
 
 typedef wasm_val_t WasmValue;
@@ -53,11 +55,247 @@ typedef std::vector<WasmFunction> WasmFunctionVector;
 typedef std::unordered_map<std::string, WasmFunctionDescriptor> WasmFunctionMap;
 typedef std::unordered_map<std::string, wasm_extern_t*> WasmExternMap;
 
+// Host functions are either generic WasmFunction objects, which are easy to
+// write but allocate vectors on every call, or direct C callbacks generated at
+// compile time by MakeHostFunction() that marshal values without allocating.
+
 struct WasmFunctionDescriptor
 {
-    WasmValueKindVector params;
-    WasmValueKindVector result;
-    WasmFunction        function;
+    WasmValueKindVector           params;
+    WasmValueKindVector           result;
+    WasmFunction                  function;
+    wasm_func_callback_with_env_t callback;
+    void*                         env;
+};
+
+template <typename T>
+struct WasmValueTraits;
+
+template <>
+struct WasmValueTraits<int32_t>
+{
+    static enum wasm_valkind_enum kind() noexcept { return WASM_I32; }
+    static int32_t fromWasm(const WasmValue& v) noexcept { return v.of.i32; }
+    static WasmValue toWasm(int32_t x) noexcept { WasmValue v = MakeI32(x); return v; }
+};
+
+template <>
+struct WasmValueTraits<uint32_t>
+{
+    static enum wasm_valkind_enum kind() noexcept { return WASM_I32; }
+    static uint32_t fromWasm(const WasmValue& v) noexcept { return static_cast<uint32_t>(v.of.i32); }
+    static WasmValue toWasm(uint32_t x) noexcept { WasmValue v = MakeI32(x); return v; }
+};
+
+template <>
+struct WasmValueTraits<bool>
+{
+    static enum wasm_valkind_enum kind() noexcept { return WASM_I32; }
+    static bool fromWasm(const WasmValue& v) noexcept { return v.of.i32 != 0; }
+    static WasmValue toWasm(bool x) noexcept { WasmValue v = MakeI32(x); return v; }
+};
+
+template <>
+struct WasmValueTraits<int64_t>
+{
+    static enum wasm_valkind_enum kind() noexcept { return WASM_I64; }
+    static int64_t fromWasm(const WasmValue& v) noexcept { return v.of.i64; }
+    static WasmValue toWasm(int64_t x) noexcept { WasmValue v = MakeI64(x); return v; }
+};
+
+template <>
+struct WasmValueTraits<uint64_t>
+{
+    static enum wasm_valkind_enum kind() noexcept { return WASM_I64; }
+    static uint64_t fromWasm(const WasmValue& v) noexcept { return static_cast<uint64_t>(v.of.i64); }
+    static WasmValue toWasm(uint64_t x) noexcept { WasmValue v = MakeI64(x); return v; }
+};
+
+template <>
+struct WasmValueTraits<float32_t>
+{
+    static enum wasm_valkind_enum kind() noexcept { return WASM_F32; }
+    static float32_t fromWasm(const WasmValue& v) noexcept { return v.of.f32; }
+    static WasmValue toWasm(float32_t x) noexcept { WasmValue v = MakeF32(x); return v; }
+};
+
+template <>
+struct WasmValueTraits<float64_t>
+{
+    static enum wasm_valkind_enum kind() noexcept { return WASM_F64; }
+    static float64_t fromWasm(const WasmValue& v) noexcept { return v.of.f64; }
+    static WasmValue toWasm(float64_t x) noexcept { WasmValue v = MakeF64(x); return v; }
+};
+
+// std::index_sequence is C++14
+
+template <size_t...>
+struct WasmIndexSequence {};
+
+template <size_t N, size_t... I>
+struct WasmMakeIndexSequence : WasmMakeIndexSequence<N - 1, N - 1, I...> {};
+
+template <size_t... I>
+struct WasmMakeIndexSequence<0, I...>
+{
+    typedef WasmIndexSequence<I...> type;
+};
+
+template <typename R>
+struct WasmHostResult
+{
+    static WasmValueKindVector kinds() { return { WasmValueTraits<R>::kind() }; }
+
+    template <class C, typename M, typename... A>
+    static void call(wasm_val_vec_t* resultVec, C* object, M method, A... args)
+    {
+        resultVec->data[0] = WasmValueTraits<R>::toWasm((object->*method)(args...));
+    }
+};
+
+template <>
+struct WasmHostResult<void>
+{
+    static WasmValueKindVector kinds() { return {}; }
+
+    template <class C, typename M, typename... A>
+    static void call(wasm_val_vec_t* resultVec, C* object, M method, A... args)
+    {
+        (void)resultVec;
+        (object->*method)(args...);
+    }
+};
+
+template <typename M, M method>
+struct WasmHostFunction;
+
+template <class C, typename R, typename... A, R (C::*method)(A...)>
+struct WasmHostFunction<R (C::*)(A...), method>
+{
+    static WasmFunctionDescriptor descriptor(C* object)
+    {
+        return { { WasmValueTraits<A>::kind()... }, WasmHostResult<R>::kinds(), nullptr,
+                    WasmHostFunction::callback, object };
+    }
+
+    static wasm_trap_t* callback(void* env, const wasm_val_vec_t* paramsVec, wasm_val_vec_t* resultVec)
+    {
+        invoke(static_cast<C *>(env), paramsVec->data, resultVec,
+                typename WasmMakeIndexSequence<sizeof...(A)>::type());
+        return nullptr;
+    }
+
+private:
+    template <size_t... I>
+    static void invoke(C* object, const WasmValue* params, wasm_val_vec_t* resultVec,
+                        WasmIndexSequence<I...>)
+    {
+        (void)params;
+        WasmHostResult<R>::call(resultVec, object, method, WasmValueTraits<A>::fromWasm(params[I])...);
+    }
+
+};
+
+#define MakeHostFunction(method, object) WasmHostFunction<decltype(&method), &method>::descriptor(object)
+
+// Handles to module exports resolved once after createInstance(). Calling
+// through a handle skips the exports map lookup and does not allocate memory
+// unless the call traps. Handles become invalid when the instance is destroyed.
+
+class WasmFunctionHandle
+{
+public:
+    WasmFunctionHandle() noexcept
+        : fRuntime(nullptr)
+        , fFunc(nullptr)
+        , fName(nullptr)
+    {}
+
+    bool isValid() const noexcept
+    {
+        return fFunc != nullptr;
+    }
+
+    void        call(std::initializer_list<WasmValue> params = {}) const;
+    WasmValue   callReturnSingleValue(std::initializer_list<WasmValue> params = {}) const;
+    const char* callReturnCString(std::initializer_list<WasmValue> params = {}) const;
+
+    // Status code variant for real-time threads, it neither throws nor builds
+    // error messages. Returns false if the handle is unresolved or call traps.
+    bool tryCall(std::initializer_list<WasmValue> params = {}, WasmValue* result = nullptr) const noexcept;
+
+private:
+    friend class WasmRuntime;
+
+    WasmRuntime*       fRuntime;
+    const wasm_func_t* fFunc;
+    const char*        fName;
+
+};
+
+class WasmGlobalHandle
+{
+public:
+    WasmGlobalHandle() noexcept
+        : fRuntime(nullptr)
+        , fGlobal(nullptr)
+    {}
+
+    bool isValid() const noexcept
+    {
+        return fGlobal != nullptr;
+    }
+
+    WasmValue get() const;
+    void      set(const WasmValue& value) const;
+    char*     getAsCString() const;
+
+private:
+    friend class WasmRuntime;
+
+    WasmRuntime*   fRuntime;
+    wasm_global_t* fGlobal;
+
+};
+
+// Memory handles cache the linear memory base address and size. Memory can
+// only grow while Wasm code runs, so the cache is refreshed after the runtime
+// returns from a call, or when the size changed if accessed from a host
+// function. Span accessors return null instead of walking off the end.
+
+class WasmMemoryHandle
+{
+public:
+    WasmMemoryHandle() noexcept
+        : fRuntime(nullptr)
+        , fMemory(nullptr)
+        , fData(nullptr)
+        , fSize(0)
+        , fGeneration(0)
+    {}
+
+    bool isValid() const noexcept
+    {
+        return fMemory != nullptr;
+    }
+
+    byte_t* getData(const WasmValue& wPtr = MakeI32(0)) const;
+    size_t  getSize() const;
+
+    uint8_t*   getByteSpan(const WasmValue& wPtr, size_t size) const;
+    float32_t* getFloatSpan(const WasmValue& wPtr, size_t count) const;
+
+private:
+    friend class WasmRuntime;
+
+    void validate() const;
+
+    WasmRuntime*     fRuntime;
+    wasm_memory_t*   fMemory;
+    mutable byte_t*  fData;
+    mutable size_t   fSize;
+    mutable uint32_t fGeneration;
+
 };
 
 class WasmRuntime
@@ -84,8 +322,24 @@ public:
     WasmValue       callFunctionReturnSingleValue(const char* name, WasmValueVector params = {});
     const char*     callFunctionReturnCString(const char* name, WasmValueVector params = {});
 
+    bool               hasExport(const char* name);
+    WasmFunctionHandle getFunctionHandle(const char* name);
+    WasmGlobalHandle   getGlobalHandle(const char* name);
+    WasmMemoryHandle   getMemoryHandle(const char* name = "memory");
+
 private:
+    friend class WasmFunctionHandle;
+    friend class WasmGlobalHandle;
+    friend class WasmMemoryHandle;
+
     void destroyInstance();
+    void unloadModule();
+
+    wasm_extern_t* findExport(const char* name, const char** exportName = nullptr);
+    void           invokeFunction(const wasm_func_t* func, const char* name, const WasmValue* params,
+                                    size_t paramCount, WasmValue* result);
+    own wasm_trap_t* invokeFunctionNoThrow(const wasm_func_t* func, const WasmValue* params,
+                                            size_t paramCount, WasmValue* result) noexcept;
 
     static wasm_trap_t* callHostFunction(void *env, const wasm_val_vec_t* paramsVec, wasm_val_vec_t* resultVec);
 
@@ -101,9 +355,13 @@ private:
     wasm_store_t*      fStore;
     wasm_module_t*     fModule;
     wasm_instance_t*   fInstance;
+    uint64_t           fModuleKey;
     wasm_extern_vec_t  fExportsVec;
     WasmFunctionVector fHostFunctions;
     WasmExternMap      fModuleExports;
+    WasmMemoryHandle   fMemory;
+    uint32_t           fCallGeneration;
+    int                fCallDepth;
 #if HIPHOP_PLUGIN_WASM_WASI
     wasi_env_t*        fWasiEnv;
 #endif
@@ -0,0 +1,231 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <csignal>
+#include <cstring>
+
+#include "distrho/extra/Mutex.hpp"
+
+#include "WasmTrapHandler.hpp"
+#include "wasm_export.h"
+
+#define SIGNAL_COUNT 2
+
+USE_NAMESPACE_DISTRHO
+
+static const int kSignals[SIGNAL_COUNT] = { SIGSEGV, SIGBUS };
+
+static Mutex            gMutex;
+static bool             gInstalled = false;
+static std::atomic<bool> gInstallPending(false);
+static struct sigaction gHostActions[SIGNAL_COUNT];
+static struct sigaction gRuntimeActions[SIGNAL_COUNT];
+
+// Initial-exec TLS is already allocated when the signal handler reads it
+#define SIGNAL_SAFE_TLS __thread __attribute__((tls_model("initial-exec")))
+
+static SIGNAL_SAFE_TLS int  tCallDepth = 0;
+static SIGNAL_SAFE_TLS bool tInRuntimeHandler = false;
+
+// Releases the runtime signal state of threads that did not have one before,
+// like host audio threads
+struct ThreadEnv
+{
+    bool owned = false;
+
+    ~ThreadEnv()
+    {
+        if (owned) {
+            wasm_runtime_destroy_thread_env();
+        }
+    }
+};
+
+static thread_local ThreadEnv tThreadEnv;
+static thread_local bool      tThreadReady = false;
+
+static void forwardSignal(const struct sigaction& action, int sig, siginfo_t* info, void* context)
+{
+    if (action.sa_flags & SA_SIGINFO) {
+        action.sa_sigaction(sig, info, context);
+        return;
+    }
+
+    if ((action.sa_handler == SIG_DFL) || (action.sa_handler == SIG_IGN)) {
+        // Faulting instruction runs again and gets the default action, an
+        // ignored SIGSEGV would loop forever
+        struct sigaction defaultAction;
+        std::memset(&defaultAction, 0, sizeof(defaultAction));
+        defaultAction.sa_handler = SIG_DFL;
+        sigemptyset(&defaultAction.sa_mask);
+        sigaction(sig, &defaultAction, nullptr);
+        return;
+    }
+
+    action.sa_handler(sig);
+}
+
+static void handleSignal(int sig, siginfo_t* info, void* context)
+{
+    const int i = sig == SIGSEGV ? 0 : 1;
+
+    // Runtime handler does not return for guard page hits, it unwinds to the
+    // Wasm call site. If it returns the fault is unrelated to Wasm memory, it
+    // might also forward back here through its own previous handler.
+    if ((tCallDepth > 0) && ! tInRuntimeHandler) {
+        tInRuntimeHandler = true;
+        forwardSignal(gRuntimeActions[i], sig, info, context);
+        tInRuntimeHandler = false;
+        return;
+    }
+
+    forwardSignal(gHostActions[i], sig, info, context);
+}
+
+static bool isOwnAction(const struct sigaction& action)
+{
+    return (action.sa_flags & SA_SIGINFO) && (action.sa_sigaction == handleSignal);
+}
+
+void WasmTrapHandler::captureHostHandlers()
+{
+    const MutexLocker locker(gMutex);
+
+    for (int i = 0; i < SIGNAL_COUNT; ++i) {
+        sigaction(kSignals[i], nullptr, &gHostActions[i]);
+
+        // Left over from a previous runtime, see uninstall()
+        if (isOwnAction(gHostActions[i])) {
+            std::memset(&gHostActions[i], 0, sizeof(gHostActions[i]));
+            gHostActions[i].sa_handler = SIG_DFL;
+        }
+    }
+
+    gInstalled = false;
+}
+
+void WasmTrapHandler::install()
+{
+    const MutexLocker locker(gMutex);
+
+    // Threads initialized from now on set it again
+    gInstallPending.store(false, std::memory_order_release);
+
+    for (int i = 0; i < SIGNAL_COUNT; ++i) {
+        struct sigaction current;
+        sigaction(kSignals[i], nullptr, &current);
+
+        if (isOwnAction(current)) {
+            continue;
+        }
+
+        // Runtime (re)installs its handler when initializing a thread,
+        // anything else was installed by the host after us
+        if (! gInstalled || ((current.sa_flags & SA_SIGINFO)
+                && (current.sa_sigaction == gRuntimeActions[i].sa_sigaction))) {
+            gRuntimeActions[i] = current;
+        } else {
+            gHostActions[i] = current;
+        }
+
+        struct sigaction action;
+        std::memset(&action, 0, sizeof(action));
+        action.sa_sigaction = handleSignal;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        sigaction(kSignals[i], &action, nullptr);
+    }
+
+    gInstalled = true;
+}
+
+void WasmTrapHandler::uninstall()
+{
+    const MutexLocker locker(gMutex);
+
+    for (int i = 0; i < SIGNAL_COUNT; ++i) {
+        struct sigaction current;
+        sigaction(kSignals[i], nullptr, &current);
+
+        if (isOwnAction(current)) {
+            sigaction(kSignals[i], &gHostActions[i], nullptr);
+        }
+    }
+
+    gInstalled = false;
+}
+
+// Returns true if the runtime signal state was created, which also installs
+// the runtime signal handler again
+static bool initThreadEnv() noexcept
+{
+    if (tThreadReady) {
+        return false;
+    }
+
+    tThreadReady = true;
+
+    if (wasm_runtime_thread_env_inited()) {
+        return false; // thread that initialized the runtime
+    }
+
+    if (! wasm_runtime_init_thread_env()) {
+        d_stderr2("WasmTrapHandler : wasm_runtime_init_thread_env() failed");
+        return false;
+    }
+
+    tThreadEnv.owned = true;
+
+    return true;
+}
+
+void WasmTrapHandler::initThread() noexcept
+{
+    if (initThreadEnv()) {
+        install();
+    }
+}
+
+void WasmTrapHandler::initAudioThread() noexcept
+{
+    if (initThreadEnv()) {
+        gInstallPending.store(true, std::memory_order_release);
+    }
+}
+
+bool WasmTrapHandler::isThreadReady() noexcept
+{
+    return tThreadReady;
+}
+
+bool WasmTrapHandler::isInstallPending() noexcept
+{
+    return gInstallPending.load(std::memory_order_acquire);
+}
+
+WasmTrapHandler::ScopedCall::ScopedCall() noexcept
+{
+    tCallDepth++;
+}
+
+WasmTrapHandler::ScopedCall::~ScopedCall() noexcept
+{
+    tCallDepth--;
+    tInRuntimeHandler = false;
+}
@@ -0,0 +1,69 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef WASM_TRAP_HANDLER_HPP
+#define WASM_TRAP_HANDLER_HPP
+
+#include "src/DistrhoDefines.h"
+
+START_NAMESPACE_DISTRHO
+
+// With HIPHOP_WASM_HW_BOUND_CHECK, AOT code does not check linear memory
+// accesses. Out of bounds accesses hit guard pages instead and raise SIGSEGV,
+// and WAMR turns them into traps from its own signal handler. That handler
+// is process-wide, so a host that installs its own handler later disables
+// it, and a host handler installed before it only runs if WAMR forwards to it.
+//
+// WasmTrapHandler sits in front of both. Faults on threads running Wasm go to
+// the runtime handler, all others go to the host handler. install() is called
+// again on activation so a handler replaced by the host gets chained instead
+// of lost. Linux only.
+
+class WasmTrapHandler
+{
+public:
+    // Called by WasmModuleRegistry around runtime initialization
+    static void captureHostHandlers();
+    static void install();
+    static void uninstall();
+
+    // Runtime signal state must exist on every thread calling into Wasm. It
+    // is not real-time safe to create, WasmPlugin calls initThread() on
+    // construction, on activation and on its loader thread. Hosts usually
+    // process on another thread, run() then calls initAudioThread() once: a
+    // one-off cost per thread (TLS and a signal stack), it does not lock. The
+    // runtime puts its handler in front while doing so, install() is left to
+    // a non real-time thread that checks isInstallPending().
+    static void initThread() noexcept;
+    static void initAudioThread() noexcept;
+    static bool isThreadReady() noexcept;
+    static bool isInstallPending() noexcept;
+
+    // Marks the current thread as running Wasm code
+    class ScopedCall
+    {
+    public:
+        ScopedCall() noexcept;
+        ~ScopedCall() noexcept;
+    };
+
+};
+
+END_NAMESPACE_DISTRHO
+
+#endif  // WASM_TRAP_HANDLER_HPP
@@ -0,0 +1,172 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Times run() of one or more modules outside a plugin host, the same way
+// WasmPlugin calls it. Every few blocks a shorter one is passed like the last
+// block of a split run() call. Linear memory growth after warming up is also
+// reported, it must be zero for modules built in GC-free mode, see index.ts.
+// Modules are given the same input so builds can be compared, for example
+// with and without SIMD. Host functions are stubbed like in describe.js.
+//
+// Usage: node bench.js [options] module.wasm [module.wasm ...]
+//
+//   --frames N   maximum block size (256)
+//   --blocks N   timed blocks per module (20000)
+//   --inputs N   audio inputs (2)
+//   --outputs N  audio outputs (2)
+//   --notes N    MIDI note on/off events per block (0)
+
+const fs = require('fs')
+
+const SAMPLE_RATE = 48000
+const MIDI_BLOCK_BYTES = 16384
+const WARMUP_BLOCKS = 1000
+const SHORT_BLOCK_INTERVAL = 4
+
+const options = { frames: 256, blocks: 20000, inputs: 2, outputs: 2, notes: 0 }
+const modulePaths = []
+
+for (let args = process.argv.slice(2); args.length > 0; ) {
+    const arg = args.shift()
+
+    if (arg.startsWith('--')) {
+        const name = arg.substring(2)
+
+        if (!(name in options) || (args.length == 0) || isNaN(args[0])) {
+            usage()
+        }
+
+        options[name] = Number(args.shift())
+    } else {
+        modulePaths.push(arg)
+    }
+}
+
+if ((modulePaths.length == 0) || (options.frames < 2)) {
+    usage()
+}
+
+const results = modulePaths.map(bench)
+const baseline = results[0].nsPerFrame
+
+console.log('module'.padEnd(40), 'ns/block'.padStart(10), 'ns/frame'.padStart(10),
+            'speedup'.padStart(8), 'mem growth'.padStart(12))
+
+for (const r of results) {
+    console.log(r.path.padEnd(40), r.nsPerBlock.toFixed(0).padStart(10), r.nsPerFrame.toFixed(2).padStart(10),
+                (baseline / r.nsPerFrame).toFixed(2).padStart(8), `${r.memoryGrowth} B`.padStart(12))
+}
+
+function usage() {
+    console.error('Usage: node bench.js [--frames N] [--blocks N] [--inputs N] [--outputs N] [--notes N] module.wasm ...')
+    process.exit(1)
+}
+
+function bench(path) {
+    const wasmModule = new WebAssembly.Module(fs.readFileSync(path))
+    const imports = {}
+
+    for (const imp of WebAssembly.Module.imports(wasmModule)) {
+        if (imp.kind != 'function') {
+            continue
+        }
+
+        imports[imp.module] = imports[imp.module] || {}
+        imports[imp.module][imp.name] = imp.name == 'abort'
+            ? () => { throw new Error(`${path} aborted`) }
+            : imp.name == 'get_samplerate' ? () => SAMPLE_RATE : () => 0
+    }
+
+    const wasmExports = new WebAssembly.Instance(wasmModule, imports).exports
+
+    for (const name of ['memory', 'run', 'activate', 'alloc_blocks', '_rw_input_block', '_rw_midi_block']) {
+        if (!(name in wasmExports)) {
+            console.error(`${path} does not export ${name}, rebuild it with the current index.ts`)
+            process.exit(1)
+        }
+    }
+
+    wasmExports._rw_num_inputs.value = options.inputs
+    wasmExports._rw_num_outputs.value = options.outputs
+
+    if ('alloc_output_parameters' in wasmExports) {
+        wasmExports.alloc_output_parameters(0)
+    }
+
+    wasmExports.alloc_blocks(options.frames, MIDI_BLOCK_BYTES)
+
+    const context = new DataView(wasmExports.memory.buffer, wasmExports._rw_context_block.value >>> 0)
+    context.setFloat64(0, SAMPLE_RATE, /*LE*/ true)
+    context.setUint32(8, options.frames, /*LE*/ true)
+
+    wasmExports.activate()
+
+    // Same input for every module, reproducible pseudo random noise
+    let seed = 1
+    const noise = new Float32Array(options.inputs * options.frames)
+
+    for (let i = 0; i < noise.length; ++i) {
+        seed = (seed * 1103515245 + 12345) & 0x7fffffff
+        noise[i] = seed / 0x3fffffff - 1
+    }
+
+    const shortFrames = options.frames - (options.frames >> 2)
+    let totalFrames = 0
+
+    const runBlock = (i) => {
+        const frames = (i % SHORT_BLOCK_INTERVAL) == SHORT_BLOCK_INTERVAL - 1 ? shortFrames : options.frames
+        const memory = wasmExports.memory.buffer   // might have been replaced by growth
+        new Float32Array(memory, wasmExports._rw_input_block.value >>> 0, options.inputs * frames)
+            .set(noise.subarray(0, options.inputs * frames))
+
+        const midi = new DataView(memory, wasmExports._rw_midi_block.value >>> 0)
+
+        for (let j = 0; j < options.notes; ++j) {
+            const offset = 11 * j
+            midi.setUint32(offset, Math.floor(j * frames / options.notes), /*LE*/ true)
+            midi.setUint32(offset + 4, 3, /*LE*/ true)
+            midi.setUint8(offset + 8, (i + j) % 2 ? 0x80 : 0x90)
+            midi.setUint8(offset + 9, 36 + (j % 12))
+            midi.setUint8(offset + 10, 100)
+        }
+
+        wasmExports.run(frames, options.notes)
+
+        return frames
+    }
+
+    for (let i = 0; i < WARMUP_BLOCKS; ++i) {
+        runBlock(i)
+    }
+
+    const memoryBytes = wasmExports.memory.buffer.byteLength
+    const start = process.hrtime.bigint()
+
+    for (let i = 0; i < options.blocks; ++i) {
+        totalFrames += runBlock(i)
+    }
+
+    const elapsed = Number(process.hrtime.bigint() - start)
+
+    return {
+        path,
+        nsPerBlock: elapsed / options.blocks,
+        nsPerFrame: elapsed / totalFrames,
+        memoryGrowth: wasmExports.memory.buffer.byteLength - memoryBytes
+    }
+}
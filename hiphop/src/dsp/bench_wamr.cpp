@@ -0,0 +1,423 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Native counterpart of bench.js for WAMR AOT modules, see the wamr_bench
+// target in Makefile.plugins.mk. Times run() of each module on the same input
+// inside one runtime, so modules compiled with and without software bounds
+// checks can be compared on a runtime built with HIPHOP_WASM_HW_BOUND_CHECK.
+// Host functions are stubbed like in bench.js.
+//
+// Usage: bench_wamr [options] module.aot [module.aot ...]
+//
+//   --frames N   maximum block size (256)
+//   --blocks N   timed blocks per module (20000)
+//   --inputs N   audio inputs (2)
+//   --outputs N  audio outputs (2)
+//   --notes N    MIDI note on/off events per block (0)
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "wasm_c_api.h"
+
+#define SAMPLE_RATE 48000
+#define MIDI_BLOCK_BYTES 16384
+#define WARMUP_BLOCKS 1000
+#define SHORT_BLOCK_INTERVAL 4
+
+namespace {
+
+struct Options
+{
+    uint32_t frames  = 256;
+    uint32_t blocks  = 20000;
+    uint32_t inputs  = 2;
+    uint32_t outputs = 2;
+    uint32_t notes   = 0;
+};
+
+struct Result
+{
+    std::string path;
+    double      nsPerBlock;
+    double      nsPerFrame;
+};
+
+// Host function stub, results are zero except for get_samplerate()
+struct Stub
+{
+    wasm_store_t*               store;
+    bool                        abort;
+    float                       value;
+    std::vector<wasm_valkind_t> results;
+};
+
+Options gOptions;
+
+[[noreturn]] void usage()
+{
+    std::fprintf(stderr, "Usage: bench_wamr [--frames N] [--blocks N] [--inputs N] [--outputs N] "
+                            "[--notes N] module.aot ...\n");
+    std::exit(1);
+}
+
+std::string toString(const wasm_name_t* name)
+{
+    return std::string(name->data, name->size);
+}
+
+wasm_val_t makeI32(int32_t value)
+{
+    wasm_val_t v;
+    std::memset(&v, 0, sizeof(v));
+    v.kind = WASM_I32;
+    v.of.i32 = value;
+    return v;
+}
+
+wasm_trap_t* callStub(void* env, const wasm_val_vec_t* params, wasm_val_vec_t* results)
+{
+    (void)params;
+    Stub* stub = static_cast<Stub*>(env);
+
+    if (stub->abort) {
+        wasm_message_t message;
+        wasm_name_new_from_string_nt(&message, "Module aborted");
+        wasm_trap_t* trap = wasm_trap_new(stub->store, &message);
+        wasm_byte_vec_delete(&message);
+        return trap;
+    }
+
+    for (size_t i = 0; i < stub->results.size(); ++i) {
+        std::memset(&results->data[i], 0, sizeof(wasm_val_t));
+        results->data[i].kind = stub->results[i];
+
+        if (stub->results[i] == WASM_F32) {
+            results->data[i].of.f32 = stub->value;
+        } else if (stub->results[i] == WASM_F64) {
+            results->data[i].of.f64 = stub->value;
+        }
+    }
+
+    return nullptr;
+}
+
+class Module
+{
+public:
+    Module(wasm_store_t* store, const std::string& path)
+        : fStore(store)
+        , fModule(nullptr)
+        , fInstance(nullptr)
+    {
+        std::ifstream file(path, std::ios::binary);
+        const std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+        if (data.empty()) {
+            throw std::runtime_error(path + " cannot be read");
+        }
+
+        wasm_byte_vec_t binary;
+        wasm_byte_vec_new(&binary, data.size(), data.data());
+        fModule = wasm_module_new(fStore, &binary);
+        wasm_byte_vec_delete(&binary);
+
+        if (fModule == nullptr) {
+            throw std::runtime_error(path + " cannot be loaded");
+        }
+
+        wasm_importtype_vec_t importTypes;
+        wasm_module_imports(fModule, &importTypes);
+
+        std::vector<wasm_extern_t*> imports;
+        fStubs.resize(importTypes.size);
+
+        for (size_t i = 0; i < importTypes.size; ++i) {
+            const wasm_externtype_t* type = wasm_importtype_type(importTypes.data[i]);
+            const wasm_functype_t* funcType = wasm_externtype_as_functype_const(type);
+
+            if (funcType == nullptr) {
+                wasm_importtype_vec_delete(&importTypes);
+                throw std::runtime_error(path + " imports something other than functions");
+            }
+
+            const std::string name = toString(wasm_importtype_name(importTypes.data[i]));
+            const wasm_valtype_vec_t* results = wasm_functype_results(funcType);
+            Stub& stub = fStubs[i];
+            stub.store = fStore;
+            stub.abort = name == "abort";
+            stub.value = name == "get_samplerate" ? SAMPLE_RATE : 0;
+
+            for (size_t j = 0; j < results->size; ++j) {
+                stub.results.push_back(wasm_valtype_kind(results->data[j]));
+            }
+
+            wasm_func_t* func = wasm_func_new_with_env(fStore, funcType, callStub, &stub, nullptr);
+            imports.push_back(wasm_func_as_extern(func));
+        }
+
+        wasm_importtype_vec_delete(&importTypes);
+
+        wasm_extern_vec_t importVec;
+        wasm_extern_vec_new(&importVec, imports.size(), imports.data());
+        fInstance = wasm_instance_new(fStore, fModule, &importVec, nullptr);
+        wasm_extern_vec_delete(&importVec);
+
+        if (fInstance == nullptr) {
+            throw std::runtime_error(path + " cannot be instantiated");
+        }
+
+        wasm_exporttype_vec_t exportTypes;
+        wasm_module_exports(fModule, &exportTypes);
+        wasm_instance_exports(fInstance, &fExportsVec);
+
+        for (size_t i = 0; i < fExportsVec.size; ++i) {
+            fExports[toString(wasm_exporttype_name(exportTypes.data[i]))] = fExportsVec.data[i];
+        }
+
+        wasm_exporttype_vec_delete(&exportTypes);
+
+        for (const char* name : { "memory", "run", "activate", "alloc_blocks", "_rw_input_block",
+                                    "_rw_midi_block", "_rw_context_block" }) {
+            if (! hasExport(name)) {
+                throw std::runtime_error(path + " does not export " + name
+                                            + ", rebuild it with the current index.ts");
+            }
+        }
+    }
+
+    ~Module()
+    {
+        wasm_extern_vec_delete(&fExportsVec);
+
+        if (fInstance != nullptr) {
+            wasm_instance_delete(fInstance);
+        }
+
+        if (fModule != nullptr) {
+            wasm_module_delete(fModule);
+        }
+    }
+
+    bool hasExport(const char* name) const
+    {
+        return fExports.find(name) != fExports.end();
+    }
+
+    void call(const char* name, std::vector<wasm_val_t> params)
+    {
+        wasm_val_t result[1];
+        wasm_val_vec_t paramVec;
+        wasm_val_vec_new(&paramVec, params.size(), params.data());
+        wasm_val_vec_t resultVec = WASM_ARRAY_VEC(result);
+
+        wasm_trap_t* trap = wasm_func_call(wasm_extern_as_func(fExports[name]), &paramVec, &resultVec);
+        wasm_val_vec_delete(&paramVec);
+
+        if (trap != nullptr) {
+            wasm_trap_delete(trap);
+            throw std::runtime_error(std::string("Failed call to function ") + name);
+        }
+    }
+
+    uint32_t getGlobal(const char* name)
+    {
+        wasm_val_t value;
+        wasm_global_get(wasm_extern_as_global(fExports[name]), &value);
+        return static_cast<uint32_t>(value.of.i32);
+    }
+
+    void setGlobal(const char* name, uint32_t value)
+    {
+        const wasm_val_t v = makeI32(static_cast<int32_t>(value));
+        wasm_global_set(wasm_extern_as_global(fExports[name]), &v);
+    }
+
+    // Linear memory might move when it grows, do not keep the pointer
+    uint8_t* getMemory(uint32_t offset, size_t size)
+    {
+        wasm_memory_t* memory = wasm_extern_as_memory(fExports["memory"]);
+
+        if (offset + size > wasm_memory_data_size(memory)) {
+            throw std::runtime_error("Block exceeds linear memory");
+        }
+
+        return reinterpret_cast<uint8_t*>(wasm_memory_data(memory)) + offset;
+    }
+
+private:
+    wasm_store_t*                        fStore;
+    wasm_module_t*                       fModule;
+    wasm_instance_t*                     fInstance;
+    wasm_extern_vec_t                    fExportsVec = WASM_EMPTY_VEC;
+    std::map<std::string,wasm_extern_t*> fExports;
+    std::vector<Stub>                    fStubs;
+
+};
+
+Result bench(wasm_store_t* store, const std::string& path)
+{
+    Module module(store, path);
+    const Options& o = gOptions;
+
+    module.setGlobal("_rw_num_inputs", o.inputs);
+    module.setGlobal("_rw_num_outputs", o.outputs);
+
+    if (module.hasExport("alloc_output_parameters")) {
+        module.call("alloc_output_parameters", { makeI32(0) });
+    }
+
+    module.call("alloc_blocks", { makeI32(o.frames), makeI32(MIDI_BLOCK_BYTES) });
+
+    const double sampleRate = SAMPLE_RATE;
+    uint8_t* context = module.getMemory(module.getGlobal("_rw_context_block"), 12);
+    std::memcpy(context, &sampleRate, 8);
+    std::memcpy(context + 8, &o.frames, 4);
+
+    module.call("activate", {});
+
+    // Same input as bench.js
+    uint32_t seed = 1;
+    std::vector<float> noise(o.inputs * o.frames);
+
+    for (float& sample : noise) {
+        seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+        sample = static_cast<float>(seed) / 0x3fffffff - 1;
+    }
+
+    const uint32_t shortFrames = o.frames - (o.frames >> 2);
+
+    auto runBlock = [&](uint32_t i) -> uint32_t {
+        const uint32_t frames = (i % SHORT_BLOCK_INTERVAL) == SHORT_BLOCK_INTERVAL - 1 ? shortFrames : o.frames;
+        std::memcpy(module.getMemory(module.getGlobal("_rw_input_block"), o.inputs * frames * 4),
+                    noise.data(), o.inputs * frames * 4);
+
+        uint8_t* midi = module.getMemory(module.getGlobal("_rw_midi_block"), 11 * o.notes);
+
+        for (uint32_t j = 0; j < o.notes; ++j) {
+            const uint32_t frame = j * frames / o.notes;
+            const uint32_t size = 3;
+            uint8_t* event = midi + 11 * j;
+            std::memcpy(event, &frame, 4);
+            std::memcpy(event + 4, &size, 4);
+            event[8] = (i + j) % 2 ? 0x80 : 0x90;
+            event[9] = 36 + (j % 12);
+            event[10] = 100;
+        }
+
+        module.call("run", { makeI32(frames), makeI32(o.notes) });
+
+        return frames;
+    };
+
+    for (uint32_t i = 0; i < WARMUP_BLOCKS; ++i) {
+        runBlock(i);
+    }
+
+    uint64_t totalFrames = 0;
+    const auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < o.blocks; ++i) {
+        totalFrames += runBlock(i);
+    }
+
+    const double elapsed = std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now() - start).count();
+
+    return { path, elapsed / o.blocks, elapsed / totalFrames };
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> paths;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+
+        if (arg.compare(0, 2, "--") != 0) {
+            paths.push_back(arg);
+            continue;
+        }
+
+        if (i + 1 == argc) {
+            usage();
+        }
+
+        const uint32_t value = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+
+        if (arg == "--frames") {
+            gOptions.frames = value;
+        } else if (arg == "--blocks") {
+            gOptions.blocks = value;
+        } else if (arg == "--inputs") {
+            gOptions.inputs = value;
+        } else if (arg == "--outputs") {
+            gOptions.outputs = value;
+        } else if (arg == "--notes") {
+            gOptions.notes = value;
+        } else {
+            usage();
+        }
+    }
+
+    if (paths.empty() || (gOptions.frames < 2) || (gOptions.blocks == 0)) {
+        usage();
+    }
+
+    // Runtime signal state is set up for the thread that creates the engine
+    wasm_engine_t* engine = wasm_engine_new();
+    wasm_store_t* store = wasm_store_new(engine);
+    std::vector<Result> results;
+    int status = 0;
+
+    try {
+        for (const std::string& path : paths) {
+            results.push_back(bench(store, path));
+        }
+    } catch (const std::exception& ex) {
+        std::fprintf(stderr, "%s\n", ex.what());
+        status = 1;
+    }
+
+    wasm_store_delete(store);
+    wasm_engine_delete(engine);
+
+    if (status != 0) {
+        return status;
+    }
+
+    std::printf("%-40s %10s %10s %8s\n", "module", "ns/block", "ns/frame", "speedup");
+
+    for (const Result& r : results) {
+        std::printf("%-40s %10.0f %10.2f %8.2f\n", r.path.c_str(), r.nsPerBlock, r.nsPerFrame,
+                    results[0].nsPerFrame / r.nsPerFrame);
+    }
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Writes the describe_plugin() table of a module to a file at build time, see
+// HIPHOP_WASM_LAZY in Makefile.plugins.mk. Host functions are stubbed, plugin
+// metadata must not depend on them.
+//
+// Usage: node describe.js module.wasm descriptor.bin parameters programs states
+
+const fs = require('fs')
+
+const [modulePath, outputPath, ...counts] = process.argv.slice(2)
+
+if (counts.length != 3) {
+    console.error('Usage: node describe.js module.wasm descriptor.bin parameters programs states')
+    process.exit(1)
+}
+
+const wasmModule = new WebAssembly.Module(fs.readFileSync(modulePath))
+const imports = {}
+
+for (const imp of WebAssembly.Module.imports(wasmModule)) {
+    if (imp.kind != 'function') {
+        continue
+    }
+
+    imports[imp.module] = imports[imp.module] || {}
+    imports[imp.module][imp.name] = imp.name == 'abort'
+        ? () => { throw new Error('Module aborted while describing plugin') }
+        : () => 0
+}
+
+const wasmExports = new WebAssembly.Instance(wasmModule, imports).exports
+
+if (typeof wasmExports.describe_plugin != 'function') {
+    console.error(`${modulePath} does not export describe_plugin()`)
+    process.exit(1)
+}
+
+const ptr = wasmExports.describe_plugin(...counts.map(Number)) >>> 0
+const size = wasmExports._rw_int32_0.value >>> 0
+const table = new Uint8Array(wasmExports.memory.buffer, ptr, size)
+
+// Check the table like WasmPlugin::parseDescriptor() does, the plugin would
+// otherwise reject it at runtime and silently fall back to eager loading
+const tableCounts = readCounts(table)
+
+if (tableCounts.join() != counts.map(Number).join()) {
+    console.error(`Plugin descriptor counts ${tableCounts.join('/')} do not match`
+                    + ` HIPHOP_WASM_*_COUNT ${counts.join('/')}`)
+    process.exit(1)
+}
+
+fs.writeFileSync(outputPath, table)
+
+function readCounts(table) {
+    const view = new DataView(table.buffer, table.byteOffset, table.byteLength)
+    const result = []
+    let offset = 16     // descriptor version, plugin version and unique id
+
+    const skip = (bytes) => {
+        if (offset + bytes > view.byteLength) {
+            console.error('Plugin descriptor is truncated')
+            process.exit(1)
+        }
+
+        offset += bytes
+    }
+
+    const u32 = () => {
+        skip(4)
+        return view.getUint32(offset - 4, /*LE*/ true)
+    }
+
+    const string = () => skip(u32())
+
+    const list = (item) => {
+        const count = u32()
+
+        for (let i = 0; i < count; ++i) {
+            item()
+        }
+
+        result.push(count)
+    }
+
+    skip(0)                                         // fixed size header
+    string(); string(); string()                    // label, maker, license
+    list(() => { skip(16); string() })              // parameters
+    list(string)                                    // programs
+    list(() => { skip(4); string(); string(); string(); string() })  // states
+
+    return result
+}
@@ -19,7 +19,19 @@
 // This file attempts to mimic the C++ public plugin interfaces.
 // See index.ts for the low level host<->plugin bridge implementation.
 
-import { _get_samplerate, _get_time_position, _write_midi_event } from './index'
+import { _get_samplerate, _get_buffer_size, _get_time_position, _write_midi_event } from './index'
+
+// Optional native DSP kernels implemented by the host, see NativeKernels.hpp.
+// Unlike the host functions declared in index.ts these are only imported by
+// modules that actually call them, so they do not need to be present when the
+// plugin is built without HIPHOP_WASM_NATIVE_KERNELS=true.
+
+declare function native_fft_prepare(log2Size: i32): bool
+declare function native_fft(data: usize, log2Size: i32, inverse: bool): bool
+declare function native_fir(dst: usize, src: usize, frames: i32, coeffs: usize, taps: i32): bool
+declare function native_complex_mac(dst: usize, a: usize, b: usize, count: i32): bool
+declare function native_polyphase(dst: usize, dstFrames: i32, src: usize, srcFrames: i32,
+                                  bank: usize, phases: i32, taps: i32, position: f64, step: f64): i32
 
 export default namespace DISTRHO {
 
@@ -79,6 +91,11 @@ export default namespace DISTRHO {
         //                  const MidiEvent* midiEvents, uint32_t midiEventCount)
         run(inputs: Float32Array[], outputs: Float32Array[], midiEvents: MidiEvent[]): void
 
+        // Not part of C++ DISTRHO::Plugin. Optional methods for keeping state
+        // when the module is hot-swapped, implement both or none of them:
+        // serializeState(): ArrayBuffer
+        // restoreState(state: ArrayBuffer): void
+
     }
 
     export class Plugin {
@@ -88,6 +105,11 @@ export default namespace DISTRHO {
             return _get_samplerate()
         }
 
+        // uint32_t Plugin::getBufferSize()
+        getBufferSize(): u32 {
+            return _get_buffer_size()
+        }
+
         // const TimePosition& Plugin::getTimePosition()
         getTimePosition(): TimePosition {
             return _get_time_position()
@@ -98,6 +120,13 @@ export default namespace DISTRHO {
             return _write_midi_event(midiEvent)
         }
 
+        // Parameter changes delivered with the current run() call. They have
+        // already been applied through setParameterValue() when run() starts,
+        // the list allows for scheduling them at their frame instead.
+        getParameterEvents(): ParameterEvent[] {
+            return parameterEventList
+        }
+
     }
 
     // struct DISTRHO::Parameter
@@ -139,11 +168,39 @@ export default namespace DISTRHO {
 
     }
 
+    // Parameter change queued by the host between two run() calls
+    export class ParameterEvent {
+
+        frame: u32
+        index: u32
+        value: f32
+
+    }
+
+    // Filled by index.ts before each run() call
+    export const parameterEventList: ParameterEvent[] = []
+
     // struct DISTRHO::TimePosition
     export class TimePosition {
 
         playing: bool
         frame: u64
+        bbt: BarBeatTick = new BarBeatTick
+
+    }
+
+    // struct DISTRHO::TimePosition::BarBeatTick
+    export class BarBeatTick {
+
+        valid: bool
+        bar: i32
+        beat: i32
+        tick: f64
+        barStartTick: f64
+        beatsPerBar: f32
+        beatType: f32
+        ticksPerBeat: f64
+        beatsPerMinute: f64
 
     }
 
@@ -175,6 +232,393 @@ export default namespace DISTRHO {
                         <u8>s.charCodeAt(2), <u8>s.charCodeAt(3))
     }
 
+    // Bump allocator for per-block temporaries, mostly useful for plugins built
+    // in GC-free mode (see index.ts) that cannot allocate in run(). Memory is
+    // released after every call to run(), pointers must not be kept around.
+
+    export class Arena {
+
+        private buffer: ArrayBuffer
+        private size: i32
+        private offset: i32 = 0
+
+        // Deferred arenas allocate their buffer on reserve(), until then
+        // alloc() always fails
+        constructor(size: i32, deferred: bool = false) {
+            this.size = size
+            this.buffer = new ArrayBuffer(deferred ? 0 : size)
+        }
+
+        reserve(): void {
+            if (this.buffer.byteLength < this.size) {
+                this.buffer = new ArrayBuffer(this.size)
+                this.offset = 0
+            }
+        }
+
+        // Returns a 16-byte aligned pointer suitable for SIMD access or 0 when
+        // the arena is exhausted
+        alloc(size: i32): usize {
+            const offset = (this.offset + 15) & ~15
+
+            if (offset + size > this.buffer.byteLength) {
+                return 0
+            }
+
+            this.offset = offset + size
+
+            return changetype<usize>(this.buffer) + <usize>offset
+        }
+
+        reset(): void {
+            this.offset = 0
+        }
+
+    }
+
+    // Reserved by the framework when the plugin is activated
+    export const blockArena = new Arena(65536, /*deferred*/ true)
+
+    // Block processing helpers. These run 4 samples per instruction when the
+    // module is built with the Wasm SIMD feature (HIPHOP_WASM_SIMD=true) and
+    // fall back to scalar code otherwise.
+
+    // buf[i] *= gain
+    export function applyGain(buf: Float32Array, gain: f32): void {
+        const n = buf.length
+        let i = 0
+
+        if (ASC_FEATURE_SIMD) {
+            const ptr = buf.dataStart
+            const g = f32x4.splat(gain)
+
+            for (; i + 4 <= n; i += 4) {
+                const p = ptr + (<usize>i << 2)
+                v128.store(p, f32x4.mul(v128.load(p), g))
+            }
+        }
+
+        for (; i < n; ++i) {
+            buf[i] = buf[i] * gain
+        }
+    }
+
+    // dst[i] += src[i] * gain
+    export function mix(dst: Float32Array, src: Float32Array, gain: f32): void {
+        const n = min(dst.length, src.length)
+        let i = 0
+
+        if (ASC_FEATURE_SIMD) {
+            const dstPtr = dst.dataStart
+            const srcPtr = src.dataStart
+            const g = f32x4.splat(gain)
+
+            for (; i + 4 <= n; i += 4) {
+                const offset = <usize>i << 2
+                const d = v128.load(dstPtr + offset)
+                const s = v128.load(srcPtr + offset)
+                v128.store(dstPtr + offset, f32x4.add(d, f32x4.mul(s, g)))
+            }
+        }
+
+        for (; i < n; ++i) {
+            dst[i] = dst[i] + src[i] * gain
+        }
+    }
+
+    // dst = [ left[0], right[0], left[1], right[1], ... ]
+    export function interleave(dst: Float32Array, left: Float32Array, right: Float32Array): void {
+        const n = min(min(left.length, right.length), dst.length >> 1)
+        let i = 0
+
+        if (ASC_FEATURE_SIMD) {
+            const dstPtr = dst.dataStart
+            const leftPtr = left.dataStart
+            const rightPtr = right.dataStart
+
+            for (; i + 4 <= n; i += 4) {
+                const offset = <usize>i << 2
+                const l = v128.load(leftPtr + offset)
+                const r = v128.load(rightPtr + offset)
+                v128.store(dstPtr + (offset << 1), v128.shuffle<f32>(l, r, 0, 4, 1, 5))
+                v128.store(dstPtr + (offset << 1) + 16, v128.shuffle<f32>(l, r, 2, 6, 3, 7))
+            }
+        }
+
+        for (; i < n; ++i) {
+            dst[i << 1] = left[i]
+            dst[(i << 1) + 1] = right[i]
+        }
+    }
+
+    // Approximation of exp() for 4 values at once, relative error < 1e-6.
+    // Only available in SIMD builds, check ASC_FEATURE_SIMD before calling.
+    export function exp4(x: v128): v128 {
+        // exp(x) = 2^t = 2^n * 2^f with t = x * log2(e), n = floor(t), f in [0, 1)
+        let t = f32x4.mul(x, f32x4.splat(1.442695041))
+        t = f32x4.max(f32x4.min(t, f32x4.splat(126)), f32x4.splat(-126))
+        const n = f32x4.floor(t)
+        const f = f32x4.sub(t, n)
+
+        // Least squares fit of 2^f
+        let p = f32x4.splat(0.001875367)
+        p = f32x4.add(f32x4.mul(p, f), f32x4.splat(0.008987348))
+        p = f32x4.add(f32x4.mul(p, f), f32x4.splat(0.05583582))
+        p = f32x4.add(f32x4.mul(p, f), f32x4.splat(0.2401466))
+        p = f32x4.add(f32x4.mul(p, f), f32x4.splat(0.6931547))
+        p = f32x4.add(f32x4.mul(p, f), f32x4.splat(1.0))
+
+        // 2^n built directly in the exponent bits
+        const scale = i32x4.shl(i32x4.add(i32x4.trunc_sat_f32x4_s(n), i32x4.splat(127)), 23)
+
+        return f32x4.mul(p, scale)
+    }
+
+    // Approximation of sin() for 4 values at once, absolute error < 1e-6 for
+    // arguments that are not too far from zero (single precision reduction).
+    // Only available in SIMD builds, check ASC_FEATURE_SIMD before calling.
+    export function sin4(x: v128): v128 {
+        const PI: f32 = 3.141592654
+
+        // Reduce to [-pi, pi]
+        const k = f32x4.nearest(f32x4.mul(x, f32x4.splat(1 / (2 * PI))))
+        x = f32x4.sub(x, f32x4.mul(k, f32x4.splat(2 * PI)))
+
+        // Reflect into [-pi/2, pi/2] using sin(x) = sin(sign(x) * pi - x)
+        const sign = v128.and(x, i32x4.splat(<i32>0x80000000))
+        const reflected = f32x4.sub(v128.or(f32x4.splat(PI), sign), x)
+        const outside = f32x4.gt(f32x4.abs(x), f32x4.splat(PI / 2))
+        x = v128.bitselect(reflected, x, outside)
+
+        // Odd polynomial, least squares fit on [0, pi/2]
+        const x2 = f32x4.mul(x, x)
+        let p = f32x4.splat(2.598032e-6)
+        p = f32x4.add(f32x4.mul(p, x2), f32x4.splat(-1.980472e-4))
+        p = f32x4.add(f32x4.mul(p, x2), f32x4.splat(8.332963e-3))
+        p = f32x4.add(f32x4.mul(p, x2), f32x4.splat(-0.1666665))
+        p = f32x4.add(f32x4.mul(p, x2), f32x4.splat(1.0))
+
+        return f32x4.mul(p, x)
+    }
+
+    // Cascade of biquad sections in transposed direct form II. Filters up to
+    // four channels at once, in SIMD builds each channel occupies one lane.
+    // Coefficients are normalized, i.e. a0 = 1.
+
+    export class BiquadCascade {
+
+        private sections: i32
+        private coeffs: StaticArray<f32>  // b0 b1 b2 a1 a2 per section
+        private state: StaticArray<f32>   // z1[4] z2[4] per section
+
+        constructor(sections: i32) {
+            this.sections = sections
+            this.coeffs = new StaticArray<f32>(sections * 5)
+            this.state = new StaticArray<f32>(sections * 8)
+
+            for (let s = 0; s < sections; ++s) {
+                this.coeffs[s * 5] = 1 // pass-through
+            }
+        }
+
+        setSection(index: i32, b0: f32, b1: f32, b2: f32, a1: f32, a2: f32): void {
+            const c = index * 5
+            this.coeffs[c]     = b0
+            this.coeffs[c + 1] = b1
+            this.coeffs[c + 2] = b2
+            this.coeffs[c + 3] = a1
+            this.coeffs[c + 4] = a2
+        }
+
+        reset(): void {
+            for (let i = 0; i < this.state.length; ++i) {
+                this.state[i] = 0
+            }
+        }
+
+        // Filters channels in place, only the first four are processed
+        process(channels: Float32Array[]): void {
+            const count = min(channels.length, 4)
+
+            if (count == 0) {
+                return
+            }
+
+            let frames = channels[0].length
+
+            for (let ch = 1; ch < count; ++ch) {
+                frames = min(frames, channels[ch].length)
+            }
+
+            if (ASC_FEATURE_SIMD) {
+                this.processSimd(channels, count, frames)
+            } else {
+                this.processScalar(channels, count, frames)
+            }
+        }
+
+        private processSimd(channels: Float32Array[], count: i32, frames: i32): void {
+            // Unused lanes alias the last channel. Lanes are stored from last to
+            // first so the lane that really owns a channel is written last.
+            const p0 = channels[0].dataStart
+            const p1 = channels[min(1, count - 1)].dataStart
+            const p2 = channels[min(2, count - 1)].dataStart
+            const p3 = channels[min(3, count - 1)].dataStart
+            const coeffs = changetype<usize>(this.coeffs)
+            const state = changetype<usize>(this.state)
+
+            for (let s = 0; s < this.sections; ++s) {
+                const c = coeffs + ((<usize>s * 5) << 2)
+                const b0 = v128.load32_splat(c)
+                const b1 = v128.load32_splat(c, 4)
+                const b2 = v128.load32_splat(c, 8)
+                const a1 = v128.load32_splat(c, 12)
+                const a2 = v128.load32_splat(c, 16)
+                const z = state + (<usize>s << 5)
+                let z1 = v128.load(z)
+                let z2 = v128.load(z, 16)
+
+                for (let i = 0; i < frames; ++i) {
+                    const offset = <usize>i << 2
+                    let x = f32x4.splat(load<f32>(p0 + offset))
+                    x = f32x4.replace_lane(x, 1, load<f32>(p1 + offset))
+                    x = f32x4.replace_lane(x, 2, load<f32>(p2 + offset))
+                    x = f32x4.replace_lane(x, 3, load<f32>(p3 + offset))
+
+                    const y = f32x4.add(f32x4.mul(b0, x), z1)
+                    z1 = f32x4.add(f32x4.sub(f32x4.mul(b1, x), f32x4.mul(a1, y)), z2)
+                    z2 = f32x4.sub(f32x4.mul(b2, x), f32x4.mul(a2, y))
+
+                    store<f32>(p3 + offset, f32x4.extract_lane(y, 3))
+                    store<f32>(p2 + offset, f32x4.extract_lane(y, 2))
+                    store<f32>(p1 + offset, f32x4.extract_lane(y, 1))
+                    store<f32>(p0 + offset, f32x4.extract_lane(y, 0))
+                }
+
+                v128.store(z, z1)
+                v128.store(z, z2, 16)
+            }
+        }
+
+        private processScalar(channels: Float32Array[], count: i32, frames: i32): void {
+            for (let s = 0; s < this.sections; ++s) {
+                const c = s * 5
+                const b0 = this.coeffs[c]
+                const b1 = this.coeffs[c + 1]
+                const b2 = this.coeffs[c + 2]
+                const a1 = this.coeffs[c + 3]
+                const a2 = this.coeffs[c + 4]
+
+                for (let ch = 0; ch < count; ++ch) {
+                    const buf = channels[ch]
+                    const z = s * 8 + ch
+                    let z1 = this.state[z]
+                    let z2 = this.state[z + 4]
+
+                    for (let i = 0; i < frames; ++i) {
+                        const x = buf[i]
+                        const y = b0 * x + z1
+                        z1 = b1 * x - a1 * y + z2
+                        z2 = b2 * x - a2 * y
+                        buf[i] = y
+                    }
+
+                    this.state[z] = z1
+                    this.state[z + 4] = z2
+                }
+            }
+        }
+
+    }
+
+    // Native kernels, these require building with HIPHOP_WASM_NATIVE_KERNELS=true.
+    // They run on the host CPU using the best SIMD instruction set available
+    // and access the arrays in linear memory directly, without copying.
+
+    // Allocates tables for fft() of the given size, call it outside run()
+    export function prepareFft(size: i32): bool {
+        if ((size < 2) || ((size & (size - 1)) != 0)) {
+            return false
+        }
+
+        return native_fft_prepare(31 - clz(size))
+    }
+
+    // In place transform of data.length / 2 interleaved complex values, the
+    // inverse transform is scaled by 1 / size. Size must be prepared first.
+    export function fft(data: Float32Array, inverse: bool = false): bool {
+        const size = data.length >> 1
+
+        if ((size < 2) || ((size & (size - 1)) != 0)) {
+            return false
+        }
+
+        return native_fft(data.dataStart, 31 - clz(size), inverse)
+    }
+
+    // dst[i] += a[i] * b[i] for interleaved complex values. Together with fft()
+    // this is the building block for partitioned convolution.
+    export function complexMac(dst: Float32Array, a: Float32Array, b: Float32Array): bool {
+        const count = min(dst.length, min(a.length, b.length)) >> 1
+        return native_complex_mac(dst.dataStart, a.dataStart, b.dataStart, count)
+    }
+
+    // Writes src resampled at position + i * step into dst through a bank of
+    // phases filters with bank.length / phases taps each. Returns the number
+    // of frames written, less than dst.length when src runs out of samples.
+    export function resamplePolyphase(dst: Float32Array, src: Float32Array, bank: Float32Array,
+                                      phases: i32, position: f64, step: f64): i32 {
+        if (phases < 1) {
+            return 0
+        }
+
+        return native_polyphase(dst.dataStart, dst.length, src.dataStart, src.length,
+                                bank.dataStart, phases, bank.length / phases, position, step)
+    }
+
+    // Direct form FIR filter that keeps history across calls
+
+    export class FirFilter {
+
+        private taps: i32
+        private coeffs: Float32Array  // reversed, native_fir() correlates
+        private work: Float32Array    // taps - 1 history samples + input
+
+        constructor(coeffs: Float32Array, maxFrames: i32) {
+            this.taps = max(coeffs.length, 1)
+            this.coeffs = new Float32Array(this.taps)
+
+            for (let k = 0; k < coeffs.length; ++k) {
+                this.coeffs[k] = coeffs[coeffs.length - 1 - k]
+            }
+
+            this.work = new Float32Array(this.taps - 1 + maxFrames)
+        }
+
+        // dst and src can be the same array. Fails if src holds more than the
+        // maxFrames passed to the constructor.
+        process(dst: Float32Array, src: Float32Array): bool {
+            const frames = min(dst.length, src.length)
+            const history = this.taps - 1
+            const work = this.work.dataStart
+
+            if (frames > this.work.length - history) {
+                return false
+            }
+
+            memory.copy(work + (<usize>history << 2), src.dataStart, <usize>frames << 2)
+
+            if (! native_fir(dst.dataStart, work, frames, this.coeffs.dataStart, this.taps)) {
+                return false
+            }
+
+            memory.copy(work, work + (<usize>frames << 2), <usize>history << 2)
+
+            return true
+        }
+
+    }
+
     // Custom class for use as mutable string argument
 
     export class String {
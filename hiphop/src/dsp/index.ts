@@ -32,38 +32,68 @@ const pluginInstance = new PluginImpl
 // These are external functions implemented by the host. They are declared here
 // instead of the caller module (dpf.ts) to keep all interfaces to the host in a
 // single place (index.ts) and also to make sure all declared functions show up
-// in the module imports table.
+// in the module imports table. Native DSP kernels are the exception, they are
+// optional and declared in dpf.ts so only modules calling them import them.
 
 declare function get_samplerate(): f32
-declare function get_time_position(): void
-declare function write_midi_event(): bool
 
-// Host functions dealing with primitives can be simply re-exported, functions
-// dealing with complex types need translation. Hide complexity from dpf.ts .
+// Host functions dealing with complex types need translation, and values that
+// are available in the context block are read from there instead of crossing
+// the boundary. Hide complexity from dpf.ts .
 
-export { get_samplerate as _get_samplerate }
+export function _get_samplerate(): f32 {
+    const sampleRate = load<f64>(changetype<usize>(_rw_context_block), CONTEXT_SAMPLE_RATE)
+
+    // Context is written on activation, fall back to the host call before
+    return sampleRate != 0 ? <f32>sampleRate : get_samplerate()
+}
+
+export function _get_buffer_size(): u32 {
+    return load<u32>(changetype<usize>(_rw_context_block), CONTEXT_BUFFER_SIZE)
+}
+
+// Output events are appended to _rw_midi_out_block and forwarded by the host
+// after run() returns, the MIDI input block is left untouched.
 
 export function _write_midi_event(midiEvent: DISTRHO.MidiEvent): bool {
-    let midiOffset: i32 = 0
-    raw_midi_events.setUint32(midiOffset, midiEvent.frame, /*LE*/true)
-    midiOffset += 4
-    raw_midi_events.setUint32(midiOffset, midiEvent.data.length, /*LE*/true)
-    midiOffset += 4
+    const size = midiEvent.data.length
 
-    for (let i = 0; i < midiEvent.data.length; ++i) {
-        raw_midi_events.setUint8(midiOffset, midiEvent.data[i])
-        midiOffset++
+    if (midiOutOffset + 8 + size > _rw_midi_out_block.byteLength) {
+        return false
     }
 
-    return write_midi_event()
+    const ptr = changetype<usize>(_rw_midi_out_block) + <usize>midiOutOffset
+    store<u32>(ptr, midiEvent.frame)
+    store<u32>(ptr, size, 4)
+    memory.copy(ptr + 8, midiEvent.data.dataStart, size)
+
+    midiOutOffset += 8 + size
+    _rw_midi_out_count++
+
+    return true
 }
 
+// Reused across calls so run() does not allocate, fields are only valid until
+// the next call
+
+const timePosition = new DISTRHO.TimePosition
+
 export function _get_time_position(): DISTRHO.TimePosition {
-    get_time_position()
-    
-    let pos = new DISTRHO.TimePosition
-    pos.playing = <bool>_rw_int32_0
-    pos.frame = _rw_int64_0
+    const ptr = changetype<usize>(_rw_context_block)
+    const pos = timePosition
+    pos.playing = load<u32>(ptr, CONTEXT_PLAYING) != 0
+    pos.frame = load<u64>(ptr, CONTEXT_FRAME)
+
+    const bbt = pos.bbt
+    bbt.valid = load<u32>(ptr, CONTEXT_BBT_VALID) != 0
+    bbt.bar = load<i32>(ptr, CONTEXT_BAR)
+    bbt.beat = load<i32>(ptr, CONTEXT_BEAT)
+    bbt.tick = load<f64>(ptr, CONTEXT_TICK)
+    bbt.barStartTick = load<f64>(ptr, CONTEXT_BAR_START_TICK)
+    bbt.beatsPerBar = load<f32>(ptr, CONTEXT_BEATS_PER_BAR)
+    bbt.beatType = load<f32>(ptr, CONTEXT_BEAT_TYPE)
+    bbt.ticksPerBeat = load<f64>(ptr, CONTEXT_TICKS_PER_BEAT)
+    bbt.beatsPerMinute = load<f64>(ptr, CONTEXT_BEATS_PER_MINUTE)
 
     return pos
 }
@@ -95,8 +125,118 @@ export function get_unique_id(): i64 {
     return pluginInstance.getUniqueId()
 }
 
+// Plugin metadata table decoded once by the host, which then answers all the
+// get_* and init_* queries above without calling into the module. Values are
+// little endian, strings are UTF-8 prefixed by their u32 byte length:
+//   u32 table version, u32 plugin version, i64 unique id
+//   str label, str maker, str license
+//   u32 count, per parameter: u32 hints, f32 def, f32 min, f32 max, str name
+//   u32 count, per program: str name
+//   u32 count, per state: u32 hints, str key, str default value, str label,
+//                         str description
+// Table byte length is returned in _rw_int32_0.
+
+const DESCRIPTOR_VERSION: u32 = 1
+
+class TableWriter {
+
+    buffer: ArrayBuffer = new ArrayBuffer(1024)
+    offset: i32 = 0
+
+    writeU32(value: u32): void {
+        this.reserve(4)
+        store<u32>(changetype<usize>(this.buffer) + this.offset, value)
+        this.offset += 4
+    }
+
+    writeI64(value: i64): void {
+        this.reserve(8)
+        store<i64>(changetype<usize>(this.buffer) + this.offset, value)
+        this.offset += 8
+    }
+
+    writeF32(value: f32): void {
+        this.reserve(4)
+        store<f32>(changetype<usize>(this.buffer) + this.offset, value)
+        this.offset += 4
+    }
+
+    writeString(value: string): void {
+        const utf8 = String.UTF8.encode(value)
+        const size = utf8.byteLength
+        this.writeU32(size)
+        this.reserve(size)
+        memory.copy(changetype<usize>(this.buffer) + this.offset, changetype<usize>(utf8), size)
+        this.offset += size
+    }
+
+    private reserve(size: i32): void {
+        if (this.offset + size <= this.buffer.byteLength) {
+            return
+        }
+
+        let capacity = this.buffer.byteLength << 1
+
+        while (capacity < this.offset + size) {
+            capacity <<= 1
+        }
+
+        const buffer = new ArrayBuffer(capacity)
+        memory.copy(changetype<usize>(buffer), changetype<usize>(this.buffer), this.offset)
+        this.buffer = buffer
+    }
+
+}
+
+export function describe_plugin(parameterCount: u32, programCount: u32, stateCount: u32): ArrayBuffer {
+    const table = new TableWriter
+
+    table.writeU32(DESCRIPTOR_VERSION)
+    table.writeU32(pluginInstance.getVersion())
+    table.writeI64(pluginInstance.getUniqueId())
+    table.writeString(pluginInstance.getLabel())
+    table.writeString(pluginInstance.getMaker())
+    table.writeString(pluginInstance.getLicense())
+
+    table.writeU32(parameterCount)
+
+    for (let i: u32 = 0; i < parameterCount; ++i) {
+        const parameter = new DISTRHO.Parameter
+        pluginInstance.initParameter(i, parameter)
+        table.writeU32(parameter.hints)
+        table.writeF32(parameter.ranges.def)
+        table.writeF32(parameter.ranges.min)
+        table.writeF32(parameter.ranges.max)
+        table.writeString(parameter.name)
+    }
+
+    table.writeU32(programCount)
+
+    for (let i: u32 = 0; i < programCount; ++i) {
+        const programName = new DISTRHO.String
+        pluginInstance.initProgramName(i, programName)
+        table.writeString(programName.value)
+    }
+
+    table.writeU32(stateCount)
+
+    for (let i: u32 = 0; i < stateCount; ++i) {
+        const state = new DISTRHO.State
+        pluginInstance.initState(i, state)
+        table.writeU32(state.hints)
+        table.writeString(state.key)
+        table.writeString(state.defaultValue)
+        table.writeString(state.label)
+        table.writeString(state.description)
+    }
+
+    _rw_int32_0 = table.offset
+
+    return table.buffer
+}
+
 // See explanation below for the odd value return convention
-    
+
 export function init_parameter(index: u32): void {
     const parameter = new DISTRHO.Parameter
     pluginInstance.initParameter(index, parameter)
@@ -154,7 +294,289 @@ export function deactivate(): void {
     pluginInstance.deactivate()
 }
 
+// State migration across hot-swaps. Plugins opt in by implementing the
+// serializeState() and restoreState() methods described in dpf.ts. The host
+// calls serialize_state() on the running instance and copies the returned
+// buffer into the one provided by get_state_block() on the new instance,
+// then calls restore_state(). A null return value means not supported.
+
+let stateBlock: ArrayBuffer | null = null
+
+export function serialize_state(): ArrayBuffer | null {
+    if (!isDefined(pluginInstance.serializeState)) {
+        return null
+    }
+
+    const state = pluginInstance.serializeState()
+    _rw_int32_0 = state.byteLength
+
+    return state
+}
+
+export function get_state_block(size: u32): ArrayBuffer {
+    const block = new ArrayBuffer(size)
+    stateBlock = block // keep reference until restore_state()
+
+    return block
+}
+
+export function restore_state(): bool {
+    const block = stateBlock
+
+    if (!isDefined(pluginInstance.restoreState) || (block === null)) {
+        return false
+    }
+
+    pluginInstance.restoreState(block)
+    stateBlock = null
+
+    return true
+}
+
+// GC-free mode is selected at compile time by building with the stub or the
+// minimal AS runtime (asc --runtime stub|minimal). These runtimes never collect
+// on their own, so under this mode run() does not allocate at all. Everything
+// it needs is created ahead of time by alloc_blocks() and alloc_midi_block()
+// on the host non real-time threads. Plugin code must also avoid allocating in
+// run(), DISTRHO.blockArena provides scratch memory released after each call.
+// Default incremental runtime keeps the original allocate and collect behavior.
+// See bench.js for checking that linear memory does not grow while running.
+
+const GC_FREE: bool = ASC_RUNTIME != 2 /*Runtime.Incremental*/
+
+// MIDI events passed to a single run() call in GC-free mode, the host drops
+// and counts the rest
+
+const MIDI_EVENT_SLOTS: u32 = 512
+
+export const _ro_max_midi_events: u32 = GC_FREE ? MIDI_EVENT_SLOTS : u32.MAX_VALUE
+
+let inputViews: Float32Array[] = []
+let outputViews: Float32Array[] = []
+let viewFrames: u32 = 0
+
+// MIDI events up to kDataSize bytes are copied into slot storage and exposed
+// through views created once per possible size. Larger events (SysEx) are
+// copied into sysexStorage, shared by all slots, and exposed through a view
+// that is pointed at the copy.
+
+class MidiEventSlot {
+
+    event: DISTRHO.MidiEvent = new DISTRHO.MidiEvent
+    views: Uint8Array[] = []
+    sysex: Uint8Array = new Uint8Array(0)
+
+    constructor() {
+        const storage = new ArrayBuffer(DISTRHO.MidiEvent.kDataSize)
+
+        for (let i: u32 = 0; i <= DISTRHO.MidiEvent.kDataSize; ++i) {
+            this.views.push(Uint8Array.wrap(storage, 0, i))
+        }
+    }
+
+}
+
+let midiEventSlots: MidiEventSlot[] = []
+let midiEventList: DISTRHO.MidiEvent[] = []
+let sysexStorage = new ArrayBuffer(0)
+
+// Points an existing view at other bytes of the buffer it was created for.
+// Only the view header is written, nothing is allocated.
+
+function reshape_view(view: ArrayBufferView, dataStart: usize, byteLength: u32): void {
+    const ptr = changetype<usize>(view)
+    store<usize>(ptr + offsetof<ArrayBufferView>("dataStart"), dataStart)
+    store<i32>(ptr + offsetof<ArrayBufferView>("byteLength"), <i32>byteLength)
+}
+
+// Views are created by alloc_blocks() for the maximum block size and reshaped
+// by run() when called with fewer frames, like the last block of a split call
+// or a smaller host buffer. Blocks are planar so every channel moves.
+
+function reshape_views(frames: u32): void {
+    const inputPtr = changetype<usize>(_rw_input_block)
+
+    for (let i: i32 = 0; i < inputViews.length; ++i) {
+        reshape_view(unchecked(inputViews[i]), inputPtr + <usize>(i * frames * 4), frames * 4)
+    }
+
+    const outputPtr = changetype<usize>(_rw_output_block)
+
+    for (let i: i32 = 0; i < outputViews.length; ++i) {
+        reshape_view(unchecked(outputViews[i]), outputPtr + <usize>(i * frames * 4), frames * 4)
+    }
+
+    viewFrames = frames
+}
+
+function update_views(frames: u32): void {
+    inputViews = []
+
+    for (let i: i32 = 0; i < _rw_num_inputs; ++i) {
+        inputViews.push(Float32Array.wrap(_rw_input_block, i * frames * 4, frames))
+    }
+
+    outputViews = []
+
+    for (let i: i32 = 0; i < _rw_num_outputs; ++i) {
+        outputViews.push(Float32Array.wrap(_rw_output_block, i * frames * 4, frames))
+    }
+
+    viewFrames = frames
+}
+
+function reserve_midi_events(count: u32): void {
+    while (<u32>midiEventSlots.length < count) {
+        const slot = new MidiEventSlot
+        slot.sysex = Uint8Array.wrap(sysexStorage, 0, 0)
+        midiEventSlots.push(slot)
+    }
+}
+
+// Parameter changes are written by the host into _rw_param_block as frame,
+// index and value triples while the plugin is active. They are applied before
+// calling the plugin run() and exposed through getParameterEvents().
+
+let parameterEventPool: DISTRHO.ParameterEvent[] = []
+
+function reserve_parameter_events(count: u32): void {
+    while (<u32>parameterEventPool.length < count) {
+        parameterEventPool.push(new DISTRHO.ParameterEvent)
+    }
+}
+
+// Setting length to zero keeps the backing buffer, fill lists once so push()
+// in run() never reallocates
+
+function reserve_list_capacity<T>(list: T[], item: T, count: u32): void {
+    while (<u32>list.length < count) {
+        list.push(item)
+    }
+
+    list.length = 0
+}
+
+function apply_parameter_events(): void {
+    const list = DISTRHO.parameterEventList
+    list.length = 0
+
+    const count = load<u32>(changetype<usize>(_rw_context_block), CONTEXT_PARAM_EVENT_COUNT)
+
+    if (count == 0) {
+        return
+    }
+
+    // Keeps capacity, the pool is fully reserved by alloc_blocks() in GC-free mode
+    reserve_parameter_events(count)
+
+    const ptr = changetype<usize>(_rw_param_block)
+
+    for (let i: u32 = 0; i < count; ++i) {
+        const event = parameterEventPool[i]
+        const offset = ptr + <usize>(i * 12)
+        event.frame = load<u32>(offset)
+        event.index = load<u32>(offset, 4)
+        event.value = load<f32>(offset, 8)
+        pluginInstance.setParameterValue(event.index, event.value)
+        list.push(event)
+    }
+}
+
+// Output parameters are published after each run() call into
+// _rw_output_param_block as index and value pairs, this way the host reads
+// them without calling get_parameter_value() for every index.
+
+let outputParameterIndexes: u32[] = []
+
+export let _rw_output_param_block = new ArrayBuffer(0)
+export let _rw_output_param_count: u32 = 0
+
+export function alloc_output_parameters(parameterCount: u32): void {
+    outputParameterIndexes = []
+
+    for (let i: u32 = 0; i < parameterCount; ++i) {
+        const parameter = new DISTRHO.Parameter
+        pluginInstance.initParameter(i, parameter)
+
+        if ((parameter.hints & DISTRHO.kParameterIsOutput) != 0) {
+            outputParameterIndexes.push(i)
+        }
+    }
+
+    _rw_output_param_block = new ArrayBuffer(outputParameterIndexes.length * 8)
+    _rw_output_param_count = 0
+}
+
+function write_output_parameters(): void {
+    const count = <u32>outputParameterIndexes.length
+    const ptr = changetype<usize>(_rw_output_param_block)
+
+    for (let i: u32 = 0; i < count; ++i) {
+        const index = unchecked(outputParameterIndexes[i])
+        const offset = ptr + <usize>(i * 8)
+        store<u32>(offset, index)
+        store<f32>(offset, pluginInstance.getParameterValue(index), 4)
+    }
+
+    _rw_output_param_count = count
+}
+
+function run_gc_free(frames: u32, midiEventCount: u32): void {
+    if (frames != viewFrames) {
+        reshape_views(frames)
+    }
+
+    // Host never passes more, see _ro_max_midi_events
+    midiEventCount = min(midiEventCount, <u32>midiEventSlots.length)
+    midiEventList.length = 0
+
+    const midiPtr = changetype<usize>(_rw_midi_block)
+    const sysexPtr = changetype<usize>(sysexStorage)
+    let midiOffset: i32 = 0
+    let sysexOffset: usize = 0
+
+    for (let i: u32 = 0; i < midiEventCount; ++i) {
+        const slot = unchecked(midiEventSlots[i])
+        const event = slot.event
+        event.frame = raw_midi_events.getUint32(midiOffset, /*LE*/ true)
+        midiOffset += 4
+        let size = raw_midi_events.getUint32(midiOffset, /*LE*/ true)
+        midiOffset += 4
+
+        if (size <= DISTRHO.MidiEvent.kDataSize) {
+            event.data = unchecked(slot.views[size])
+            memory.copy(event.data.dataStart, midiPtr + midiOffset, size)
+        } else {
+            // Storage is as large as the MIDI block, all events fit
+            memory.copy(sysexPtr + sysexOffset, midiPtr + midiOffset, size)
+            reshape_view(slot.sysex, sysexPtr + sysexOffset, size)
+            event.data = slot.sysex
+            sysexOffset += size
+        }
+
+        midiOffset += size
+        midiEventList.push(event)
+    }
+
+    apply_parameter_events()
+
+    pluginInstance.run(inputViews, outputViews, midiEventList)
+
+    write_output_parameters()
+
+    DISTRHO.blockArena.reset()
+}
+
 export function run(frames: u32, midiEventCount: u32): void {
+    // Host has already forwarded the output of the previous call
+    _rw_midi_out_count = 0
+    midiOutOffset = 0
+
+    if (GC_FREE) {
+        run_gc_free(frames, midiEventCount)
+        return
+    }
+
     let inputs: Float32Array[] = []
 
     for (let i: i32 = 0; i < _rw_num_inputs; ++i) {
@@ -181,9 +603,15 @@ export function run(frames: u32, midiEventCount: u32): void {
         midiEvents.push(event)
     }
 
+    apply_parameter_events()
+
     // Count arguments are redundant, they can be inferred from arrays length.
     pluginInstance.run(inputs, outputs, midiEvents)
 
+    write_output_parameters()
+
+    DISTRHO.blockArena.reset()
+
     // Run AS GC on each _run() call for more deterministic memory mgmt.
     // This can help preventing dropouts when running at small buffer sizes.
     __collect();
@@ -197,19 +625,91 @@ export let _rw_num_outputs: i32
 
 // Using exported globals instead of passing buffer arguments to run() allows
 // for a simpler implementation by avoiding Wasm memory alloc on the host side.
-// Audio block size should not exceed 64Kb, or 16384 frames of 32-bit float
-// samples. Midi should not exceed 6Kb, or 512 events of 12 bytes (def. size)
+// The host sizes the blocks by calling alloc_blocks() on activation using the
+// maximum buffer size, and splits larger run() calls. The MIDI block is an
+// arena that the host grows through alloc_midi_block() when events, like
+// SysEx messages, do not fit.
+//
+// Blocks are empty until the first call to alloc_blocks(). Allocating them
+// when the module starts would zero fill, and therefore commit, a few hundred
+// KiB of linear memory in every instance, including those created by plugin
+// scanners that are never activated. Pages that are never written are not
+// backed by physical memory. This saves memory only, instantiation still runs
+// the start function and copies data segments.
+
+export let _rw_input_block = new ArrayBuffer(0)
+export let _rw_output_block = new ArrayBuffer(0)
+export let _rw_midi_block = new ArrayBuffer(0)
+
+let raw_midi_events = new DataView(_rw_midi_block, 0, 0)
+
+const MIDI_OUT_BLOCK_BYTES = 8192
+
+export let _rw_midi_out_block = new ArrayBuffer(0)
+export let _rw_midi_out_count: u32 = 0
+
+let midiOutOffset: i32 = 0
+
+// The host writes the context block before each run() call and on activation.
+// Offsets must match WasmPlugin::writeContext(), CONTEXT_BLOCK_BYTES in total.
+
+const CONTEXT_SAMPLE_RATE = 0          // f64
+const CONTEXT_BUFFER_SIZE = 8          // u32
+const CONTEXT_PARAM_EVENT_COUNT = 12   // u32
+const CONTEXT_PLAYING = 16             // u32
+const CONTEXT_BBT_VALID = 20           // u32
+const CONTEXT_FRAME = 24               // u64
+const CONTEXT_BAR = 32                 // i32
+const CONTEXT_BEAT = 36                // i32
+const CONTEXT_TICK = 40                // f64
+const CONTEXT_BAR_START_TICK = 48      // f64
+const CONTEXT_BEATS_PER_BAR = 56       // f32
+const CONTEXT_BEAT_TYPE = 60           // f32
+const CONTEXT_TICKS_PER_BEAT = 64      // f64
+const CONTEXT_BEATS_PER_MINUTE = 72    // f64
+const CONTEXT_BLOCK_BYTES = 80
+
+export let _rw_context_block = new ArrayBuffer(CONTEXT_BLOCK_BYTES)
+
+export const _ro_param_block_events: u32 = 1024
+
+export let _rw_param_block = new ArrayBuffer(0)
+
+export function alloc_blocks(frames: u32, midiBlockBytes: u32): void {
+    _rw_input_block = new ArrayBuffer(_rw_num_inputs * <i32>frames * 4)
+    _rw_output_block = new ArrayBuffer(_rw_num_outputs * <i32>frames * 4)
+    alloc_midi_block(midiBlockBytes)
+
+    // Fixed size blocks, allocated on first activation only
+    if (_rw_midi_out_block.byteLength == 0) {
+        _rw_midi_out_block = new ArrayBuffer(MIDI_OUT_BLOCK_BYTES)
+        _rw_param_block = new ArrayBuffer(<i32>_ro_param_block_events * 12)
+    }
 
-const MAX_AUDIO_BLOCK_BYTES = 65536
+    DISTRHO.blockArena.reserve()
 
-export let _rw_input_block = new ArrayBuffer(MAX_AUDIO_BLOCK_BYTES)
-export let _rw_output_block = new ArrayBuffer(MAX_AUDIO_BLOCK_BYTES)
+    if (GC_FREE) {
+        // Allocate ahead of time what run() would otherwise allocate
+        update_views(frames)
+        reserve_midi_events(MIDI_EVENT_SLOTS)
+        reserve_parameter_events(_ro_param_block_events)
+        reserve_list_capacity(midiEventList, midiEventSlots[0].event, MIDI_EVENT_SLOTS)
+        reserve_list_capacity(DISTRHO.parameterEventList, parameterEventPool[0], _ro_param_block_events)
+    }
+}
 
-const MAX_MIDI_EVENT_BYTES = 1536
+export function alloc_midi_block(size: u32): void {
+    _rw_midi_block = new ArrayBuffer(<i32>size)
+    raw_midi_events = new DataView(_rw_midi_block, 0, <i32>size)
 
-export let _rw_midi_block = new ArrayBuffer(MAX_MIDI_EVENT_BYTES)
+    if (GC_FREE) {
+        sysexStorage = new ArrayBuffer(<i32>size)
 
-let raw_midi_events = new DataView(_rw_midi_block, 0, MAX_MIDI_EVENT_BYTES)
+        for (let i: i32 = 0; i < midiEventSlots.length; ++i) {
+            midiEventSlots[i].sysex = Uint8Array.wrap(sysexStorage, 0, 0)
+        }
+    }
+}
 
 // AssemblyScript does not support multi-values yet. Export a couple of generic
 // variables for returning complex data types like initParameter() requires.